@@ -0,0 +1,560 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+//
+// Microbenchmarks for the synchronization and queueing primitives.
+//
+//    sbench [--format text|json|csv] [--threads N] [--messages N]
+//           [--iterations N] [--repeat N] [--filter name]
+//
+// Every benchmark runs a fixed amount of work --repeat times and reports
+// the median run, so results are comparable between builds on the same
+// host.  The json and csv formats are meant to be archived per release.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ssync.h"
+#include "squeue.h"
+#include "sthread.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+struct Options
+{
+   Options() : format( "text" ), threads( 4 ), messages( 1000000 ), iterations( 100000 ), repeat( 3 ) {}
+
+   std::string format;
+   int threads;
+   long messages;
+   long iterations;
+   int repeat;
+   std::string filter;
+};
+
+struct Result
+{
+   std::string bench;
+   std::string variant;
+   int producers;
+   int consumers;
+   std::string metric;
+   double value;
+   std::string unit;
+};
+
+Options options;
+std::vector<Result> results;
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds( Clock::time_point start )
+{
+   return std::chrono::duration<double>( Clock::now() - start ).count();
+}
+
+uint64_t nanoseconds( Clock::time_point start, Clock::time_point end )
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count();
+}
+
+double median( std::vector<double> v )
+{
+   std::sort( v.begin(), v.end() );
+   return v[ v.size() / 2 ];
+}
+
+// 1, 2, 4, ... and finally the requested thread count itself
+int nextCount( int n )
+{
+   return n < options.threads && n * 2 > options.threads ? options.threads : n * 2;
+}
+
+bool selected( const char *bench )
+{
+   return options.filter.empty() || options.filter == bench;
+}
+
+void report( const char *bench, const std::string &variant, int producers, int consumers,
+             const char *metric, double value, const char *unit )
+{
+   Result r;
+
+   r.bench = bench;
+   r.variant = variant;
+   r.producers = producers;
+   r.consumers = consumers;
+   r.metric = metric;
+   r.value = value;
+   r.unit = unit;
+
+   results.push_back( r );
+
+   if ( options.format == "text" )
+   {
+      printf( "%-12s %-14s %3dp %3dc  %-8s %14.1f %s\n", bench, variant.c_str(),
+         producers, consumers, metric, value, unit );
+      fflush( stdout );
+   }
+}
+
+//
+// releases all the threads of a run at the same time, the clock starts
+// when the last one arrives
+//
+class StartGate
+{
+public:
+   StartGate( int parties ) : m_waiting( parties ), m_open( false ) {}
+
+   void arrive()
+   {
+      if ( m_waiting.fetch_sub( 1 ) == 1 )
+      {
+         m_start = Clock::now();
+         m_open.store( true );
+      }
+
+      while ( !m_open.load() )
+         std::this_thread::yield();
+   }
+
+   Clock::time_point getStart() { return m_start; }
+
+private:
+   std::atomic<int> m_waiting;
+   std::atomic<bool> m_open;
+   Clock::time_point m_start;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// queue throughput
+////////////////////////////////////////////////////////////////////////////////
+
+double queueRun( SQueue::QueueType type, int producers, int consumers )
+{
+   SQueue q( type, type == SQueue::qtRing ? 65536 : 0 );
+   long perproducer = options.messages / producers;
+   long total = perproducer * producers;
+   std::atomic<long> consumed( 0 );
+   StartGate gate( producers + consumers + 1 );
+   std::vector<std::thread> threads;
+
+   for ( int c = 0; c < consumers; c++ )
+   {
+      threads.push_back( std::thread( [&]()
+      {
+         SQueueMessage *batch[64];
+         gate.arrive();
+         while ( consumed.load( std::memory_order_relaxed ) < total )
+         {
+            // a consumer that finds the queue empty after the last message
+            // was taken elsewhere must not block forever
+            size_t cnt = q.popBatch( batch, 64, SDeadline( 10 ) );
+            for ( size_t i = 0; i < cnt; i++ )
+               delete batch[i];
+            consumed.fetch_add( cnt, std::memory_order_relaxed );
+         }
+      } ) );
+   }
+
+   for ( int p = 0; p < producers; p++ )
+   {
+      threads.push_back( std::thread( [&]()
+      {
+         gate.arrive();
+         for ( long i = 0; i < perproducer; i++ )
+            q.push( new SQueueMessage( 1 ) );
+      } ) );
+   }
+
+   gate.arrive();
+   Clock::time_point start = gate.getStart();
+
+   for ( size_t i = 0; i < threads.size(); i++ )
+      threads[i].join();
+
+   return total / seconds( start );
+}
+
+void queueBench( const char *bench, SQueue::QueueType type, int producers, int consumers )
+{
+   std::vector<double> runs;
+
+   for ( int r = 0; r < options.repeat; r++ )
+      runs.push_back( queueRun( type, producers, consumers ) );
+
+   report( bench, type == SQueue::qtRing ? "ring" : "locked", producers, consumers,
+      "rate", median( runs ), "msg/s" );
+}
+
+class NullThread : public SEventThread
+{
+public:
+   void dispatch( SEventThreadMessage &msg ) {}
+};
+
+double postRun( SQueue::QueueType type, int producers )
+{
+   NullThread t;
+   long perproducer = options.messages / producers;
+   StartGate gate( producers + 1 );
+   std::vector<std::thread> threads;
+
+   t.initQueue( type, type == SQueue::qtRing ? 65536 : 0 );
+   t.init( NULL );
+
+   for ( int p = 0; p < producers; p++ )
+   {
+      threads.push_back( std::thread( [&]()
+      {
+         gate.arrive();
+         for ( long i = 0; i < perproducer; i++ )
+            t.postMessage( ETM_USER + 1 );
+      } ) );
+   }
+
+   gate.arrive();
+   Clock::time_point start = gate.getStart();
+
+   for ( size_t i = 0; i < threads.size(); i++ )
+      threads[i].join();
+
+   // ETM_QUIT jumps the backlog, wait for it to drain first
+   while ( t.getQueueSize() > 0 )
+      std::this_thread::yield();
+
+   double rate = perproducer * producers / seconds( start );
+
+   t.quit();
+   t.join();
+
+   return rate;
+}
+
+void postBench( SQueue::QueueType type, int producers )
+{
+   std::vector<double> runs;
+
+   for ( int r = 0; r < options.repeat; r++ )
+      runs.push_back( postRun( type, producers ) );
+
+   report( "post", type == SQueue::qtRing ? "ring" : "locked", producers, 1,
+      "rate", median( runs ), "msg/s" );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SEvent and SSemaphore round trips
+////////////////////////////////////////////////////////////////////////////////
+
+void latencyReport( const char *bench, const char *variant, std::vector<uint64_t> &samples )
+{
+   std::sort( samples.begin(), samples.end() );
+
+   size_t n = samples.size();
+
+   report( bench, variant, 1, 1, "p50", samples[ n / 2 ], "ns" );
+   report( bench, variant, 1, 1, "p90", samples[ n * 90 / 100 ], "ns" );
+   report( bench, variant, 1, 1, "p99", samples[ n * 99 / 100 ], "ns" );
+   report( bench, variant, 1, 1, "p999", samples[ n * 999 / 1000 ], "ns" );
+   report( bench, variant, 1, 1, "max", samples[ n - 1 ], "ns" );
+}
+
+void eventPingPong()
+{
+   SEvent ping, pong;
+   long iterations = options.iterations / 10 > 0 ? options.iterations / 10 : 1;
+   std::vector<uint64_t> samples;
+
+   samples.reserve( iterations );
+
+   std::thread peer( [&]()
+   {
+      for ( long i = 0; i < iterations; i++ )
+      {
+         ping.wait();
+         ping.reset();
+         pong.set();
+      }
+   } );
+
+   for ( long i = 0; i < iterations; i++ )
+   {
+      Clock::time_point start = Clock::now();
+      ping.set();
+      pong.wait();
+      pong.reset();
+      samples.push_back( nanoseconds( start, Clock::now() ) );
+   }
+
+   peer.join();
+
+   latencyReport( "pingpong", "sevent", samples );
+}
+
+void semaphorePingPong()
+{
+   SSemaphore ping( 0, 0 ), pong( 0, 0 );
+   long iterations = options.iterations / 10 > 0 ? options.iterations / 10 : 1;
+   std::vector<uint64_t> samples;
+
+   samples.reserve( iterations );
+
+   std::thread peer( [&]()
+   {
+      for ( long i = 0; i < iterations; i++ )
+      {
+         ping.decrement();
+         pong.increment();
+      }
+   } );
+
+   for ( long i = 0; i < iterations; i++ )
+   {
+      Clock::time_point start = Clock::now();
+      ping.increment();
+      pong.decrement();
+      samples.push_back( nanoseconds( start, Clock::now() ) );
+   }
+
+   peer.join();
+
+   latencyReport( "pingpong", "ssemaphore", samples );
+}
+
+void semaphoreUncontended()
+{
+   SSemaphore sem( 0, 0 );
+   std::vector<double> runs;
+
+   for ( int r = 0; r < options.repeat; r++ )
+   {
+      Clock::time_point start = Clock::now();
+      for ( long i = 0; i < options.iterations; i++ )
+      {
+         sem.increment();
+         sem.decrement();
+      }
+      runs.push_back( seconds( start ) * 1e9 / options.iterations );
+   }
+
+   report( "semaphore", "uncontended", 1, 1, "cost", median( runs ), "ns/op" );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SMutexLock
+////////////////////////////////////////////////////////////////////////////////
+
+double mutexRun( SMutex &mutex, int threads )
+{
+   long perthread = options.iterations / threads;
+   volatile long counter = 0;
+   StartGate gate( threads + 1 );
+   std::vector<std::thread> workers;
+
+   for ( int t = 0; t < threads; t++ )
+   {
+      workers.push_back( std::thread( [&]()
+      {
+         gate.arrive();
+         for ( long i = 0; i < perthread; i++ )
+         {
+            SMutexLock l( mutex );
+            counter = counter + 1;
+         }
+      } ) );
+   }
+
+   gate.arrive();
+   Clock::time_point start = gate.getStart();
+
+   for ( size_t i = 0; i < workers.size(); i++ )
+      workers[i].join();
+
+   return seconds( start ) * 1e9 / ( perthread * threads );
+}
+
+void mutexBench( const char *variant, SMutex &mutex, int threads )
+{
+   std::vector<double> runs;
+
+   for ( int r = 0; r < options.repeat; r++ )
+      runs.push_back( mutexRun( mutex, threads ) );
+
+   report( "mutex", variant, threads, 0, "cost", median( runs ), "ns/op" );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// output
+////////////////////////////////////////////////////////////////////////////////
+
+void printJSON()
+{
+   struct utsname u;
+   uname( &u );
+
+   printf( "{\n  \"host\": {\"sysname\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld},\n",
+      u.sysname, u.release, u.machine, sysconf( _SC_NPROCESSORS_ONLN ) );
+   printf( "  \"options\": {\"threads\": %d, \"messages\": %ld, \"iterations\": %ld, \"repeat\": %d},\n",
+      options.threads, options.messages, options.iterations, options.repeat );
+   printf( "  \"results\": [\n" );
+
+   for ( size_t i = 0; i < results.size(); i++ )
+   {
+      const Result &r = results[i];
+      printf( "    {\"bench\": \"%s\", \"variant\": \"%s\", \"producers\": %d, \"consumers\": %d, "
+              "\"metric\": \"%s\", \"value\": %.1f, \"unit\": \"%s\"}%s\n",
+         r.bench.c_str(), r.variant.c_str(), r.producers, r.consumers,
+         r.metric.c_str(), r.value, r.unit.c_str(), i + 1 < results.size() ? "," : "" );
+   }
+
+   printf( "  ]\n}\n" );
+}
+
+void printCSV()
+{
+   printf( "bench,variant,producers,consumers,metric,value,unit\n" );
+
+   for ( size_t i = 0; i < results.size(); i++ )
+   {
+      const Result &r = results[i];
+      printf( "%s,%s,%d,%d,%s,%.1f,%s\n", r.bench.c_str(), r.variant.c_str(),
+         r.producers, r.consumers, r.metric.c_str(), r.value, r.unit.c_str() );
+   }
+}
+
+void usage( const char *prog )
+{
+   fprintf( stderr,
+      "usage: %s [--format text|json|csv] [--threads N] [--messages N]\n"
+      "          [--iterations N] [--repeat N] [--filter spsc|mpsc|mpmc|post|pingpong|semaphore|mutex]\n",
+      prog );
+   exit( 1 );
+}
+
+void parseOptions( int argc, char **argv )
+{
+   for ( int i = 1; i < argc; i++ )
+   {
+      if ( i + 1 >= argc )
+         usage( argv[0] );
+
+      const char *arg = argv[i];
+      const char *val = argv[++i];
+
+      if ( strcmp( arg, "--format" ) == 0 )
+         options.format = val;
+      else if ( strcmp( arg, "--threads" ) == 0 )
+         options.threads = atoi( val );
+      else if ( strcmp( arg, "--messages" ) == 0 )
+         options.messages = atol( val );
+      else if ( strcmp( arg, "--iterations" ) == 0 )
+         options.iterations = atol( val );
+      else if ( strcmp( arg, "--repeat" ) == 0 )
+         options.repeat = atoi( val );
+      else if ( strcmp( arg, "--filter" ) == 0 )
+         options.filter = val;
+      else
+         usage( argv[0] );
+   }
+
+   if ( ( options.format != "text" && options.format != "json" && options.format != "csv" ) ||
+        options.threads < 1 || options.messages < 1 || options.iterations < 1 || options.repeat < 1 )
+      usage( argv[0] );
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char **argv )
+{
+   parseOptions( argc, argv );
+
+   if ( selected( "spsc" ) )
+   {
+      queueBench( "spsc", SQueue::qtLocked, 1, 1 );
+      queueBench( "spsc", SQueue::qtRing, 1, 1 );
+   }
+
+   // one producer and consumer is the spsc case, the ring only supports a
+   // single consumer
+   for ( int n = 1; n <= options.threads; n = nextCount( n ) )
+   {
+      if ( selected( "mpsc" ) && n > 1 )
+      {
+         queueBench( "mpsc", SQueue::qtLocked, n, 1 );
+         queueBench( "mpsc", SQueue::qtRing, n, 1 );
+      }
+      if ( selected( "mpmc" ) && n > 1 )
+         queueBench( "mpmc", SQueue::qtLocked, n, n );
+      if ( selected( "post" ) )
+      {
+         postBench( SQueue::qtLocked, n );
+         postBench( SQueue::qtRing, n );
+      }
+   }
+
+   if ( selected( "pingpong" ) )
+   {
+      eventPingPong();
+      semaphorePingPong();
+   }
+
+   if ( selected( "semaphore" ) )
+      semaphoreUncontended();
+
+   if ( selected( "mutex" ) )
+   {
+      SMutex recursive;
+      SMutex normal( SMutex::mtNormal );
+      SMutex spinning( SMutex::mtNormal, false, SMUTEX_DEFAULT_SPIN_COUNT );
+
+      mutexBench( "recursive", recursive, 1 );
+      mutexBench( "normal", normal, 1 );
+      mutexBench( "spinning", spinning, 1 );
+
+      for ( int n = nextCount( 1 ); n <= options.threads; n = nextCount( n ) )
+      {
+         mutexBench( "normal", normal, n );
+         mutexBench( "spinning", spinning, n );
+      }
+   }
+
+   if ( options.format == "json" )
+      printJSON();
+   else if ( options.format == "csv" )
+      printCSV();
+
+   return 0;
+}
@@ -16,6 +16,10 @@ int csGetInterval(char **response);
 int csUpdateInterval(const char *json, char **response);
 int csGetLive(char **response);
 
+/* lock contention profile of the named SMutex objects as JSON */
+void csSetLockProfiling(int enabled);
+int csGetLockProfile(char **response);
+
 #ifdef __cplusplus
 }
 #endif
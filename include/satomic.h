@@ -19,6 +19,13 @@
 
 #include <ext/atomicity.h>
 
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
 #define atomic_dec_fetch(a) __sync_sub_and_fetch(&a,1)
 #define atomic_inc_fetch(a) __sync_add_and_fetch(&a,1)
 #define atomic_fetch_dec(a) __sync_fetch_and_sub(&a,1)
@@ -37,5 +44,148 @@
 #define atomic_cas(a,b,c) __sync_val_compare_and_swap(&a,b,c)
 #define atomic_swap(a,b) __sync_lock_test_and_set(&a,b)
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Typed atomic with an explicit memory ordering on every operation.  The
+// __sync macros above are full barriers, SAtomic lets a plain counter use
+// std::memory_order_relaxed and pay for ordering only where it is needed.
+//
+template <class T>
+class SAtomic
+{
+public:
+   constexpr SAtomic() : m_value( T() ) {}
+   constexpr SAtomic( T value ) : m_value( value ) {}
+
+   T load( std::memory_order order = std::memory_order_seq_cst ) const
+   {
+      return m_value.load( order );
+   }
+
+   void store( T value, std::memory_order order = std::memory_order_seq_cst )
+   {
+      m_value.store( value, order );
+   }
+
+   T exchange( T value, std::memory_order order = std::memory_order_seq_cst )
+   {
+      return m_value.exchange( value, order );
+   }
+
+   // on failure expected is updated with the current value
+   bool compareExchange( T &expected, T desired,
+                         std::memory_order success = std::memory_order_seq_cst,
+                         std::memory_order failure = std::memory_order_relaxed )
+   {
+      return m_value.compare_exchange_strong( expected, desired, success, failure );
+   }
+
+   bool compareExchangeWeak( T &expected, T desired,
+                             std::memory_order success = std::memory_order_seq_cst,
+                             std::memory_order failure = std::memory_order_relaxed )
+   {
+      return m_value.compare_exchange_weak( expected, desired, success, failure );
+   }
+
+   T fetchAdd( T value, std::memory_order order = std::memory_order_seq_cst ) { return m_value.fetch_add( value, order ); }
+   T fetchSub( T value, std::memory_order order = std::memory_order_seq_cst ) { return m_value.fetch_sub( value, order ); }
+   T fetchAnd( T value, std::memory_order order = std::memory_order_seq_cst ) { return m_value.fetch_and( value, order ); }
+   T fetchOr( T value, std::memory_order order = std::memory_order_seq_cst )  { return m_value.fetch_or( value, order ); }
+
+   T addFetch( T value, std::memory_order order = std::memory_order_seq_cst ) { return m_value.fetch_add( value, order ) + value; }
+   T subFetch( T value, std::memory_order order = std::memory_order_seq_cst ) { return m_value.fetch_sub( value, order ) - value; }
+
+private:
+   SAtomic( const SAtomic & );
+   SAtomic &operator=( const SAtomic & );
+
+   std::atomic<T> m_value;
+};
+
+const size_t SATOMIC_CACHE_LINE = 64;
+
+//
+// SAtomic on a cache line of its own, for counters updated from several
+// threads that would otherwise share a line with unrelated data
+//
+template <class T>
+class alignas(SATOMIC_CACHE_LINE) SPaddedAtomic : public SAtomic<T>
+{
+public:
+   SPaddedAtomic() {}
+   SPaddedAtomic( T value ) : SAtomic<T>( value ) {}
+
+private:
+   char m_pad[SATOMIC_CACHE_LINE - sizeof(SAtomic<T>)];
+};
+
+//
+// Counter split into per-CPU cache lines.  add() is a relaxed increment of
+// the slot for the CPU the caller is running on, get() sums every slot, so
+// writers never contend but reads are O(number of slots).
+//
+template <class T>
+class SPerCpuCounter
+{
+public:
+   SPerCpuCounter()
+   {
+      long cpus = sysconf( _SC_NPROCESSORS_CONF );
+
+      m_slots = 1;
+      while ( (long)m_slots < cpus && m_slots < SPERCPU_MAX_SLOTS )
+         m_slots <<= 1;
+
+      void *mem = NULL;
+      if ( posix_memalign( &mem, SATOMIC_CACHE_LINE, sizeof(SPaddedAtomic<T>) * m_slots ) != 0 )
+         throw std::bad_alloc();
+
+      m_counters = static_cast<SPaddedAtomic<T>*>( mem );
+      for ( size_t i = 0; i < m_slots; i++ )
+         new ( &m_counters[i] ) SPaddedAtomic<T>( T() );
+   }
+
+   ~SPerCpuCounter()
+   {
+      for ( size_t i = 0; i < m_slots; i++ )
+         m_counters[i].~SPaddedAtomic<T>();
+      free( m_counters );
+   }
+
+   void add( T value = 1 )
+   {
+      int cpu = sched_getcpu();
+      m_counters[ ( cpu < 0 ? 0 : cpu ) & ( m_slots - 1 ) ].fetchAdd( value, std::memory_order_relaxed );
+   }
+
+   void sub( T value = 1 ) { add( -value ); }
+
+   T get() const
+   {
+      T total = T();
+      for ( size_t i = 0; i < m_slots; i++ )
+         total += m_counters[i].load( std::memory_order_relaxed );
+      return total;
+   }
+
+   // not atomic with respect to concurrent add()
+   void reset()
+   {
+      for ( size_t i = 0; i < m_slots; i++ )
+         m_counters[i].store( T(), std::memory_order_relaxed );
+   }
+
+private:
+   static const size_t SPERCPU_MAX_SLOTS = 256;
+
+   SPerCpuCounter( const SPerCpuCounter & );
+   SPerCpuCounter &operator=( const SPerCpuCounter & );
+
+   size_t m_slots;
+   SPaddedAtomic<T> *m_counters;
+};
+
 #endif // #define __SATOMIC_H
 
@@ -0,0 +1,122 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SDISPATCHSTATS_H
+#define __SDISPATCHSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "shistogram.h"
+#include "ssync.h"
+
+struct SDispatchIdStats
+{
+   uint16_t id;
+   uint64_t count;
+   SHistogram queueWait;      // microseconds from post to dispatch
+   SHistogram handlerTime;    // nanoseconds spent in the handler
+};
+
+struct SDispatchStatsData
+{
+   std::string name;
+   bool enabled;
+   size_t queueDepth;
+   size_t queuePeak;
+   uint64_t dropped;
+   uint64_t dispatched;
+   std::vector<SDispatchIdStats> ids;
+
+   //
+   // {"name":"...","enabled":true,"queue_depth":n,"queue_peak":n,
+   //  "dropped":n,"dispatched":n,"ids":[{"id":n,"count":n,
+   //  "queue_wait_us":{...},"handler_ns":{...}},...]}, sorted by id
+   //
+   void serializeJSON( std::string &json ) const;
+};
+
+//
+// Per message id dispatch statistics of one SEventThread.
+//
+// Instrumentation is off by default.  While it is on, every message is
+// stamped when it is posted and timed again when it is dispatched, the
+// dispatch thread buffers the samples of a batch and folds them into the
+// shared per id statistics once at the end of the batch.  A message posted
+// before instrumentation was turned on is counted and its handler timed,
+// but it has no queue wait.
+//
+class SDispatchStats
+{
+public:
+   SDispatchStats();
+   ~SDispatchStats();
+
+   void setEnabled( bool enabled ) { m_enabled.store( enabled, std::memory_order_relaxed ); }
+   bool isEnabled() { return m_enabled.load( std::memory_order_relaxed ); }
+
+   // dispatch thread only, waitus is ignored when stamped is false
+   void record( uint16_t id, bool stamped, uint32_t waitus, uint64_t handlerns )
+   {
+      Sample s = { id, stamped, waitus, handlerns };
+      m_pending.push_back( s );
+   }
+
+   // folds the samples recorded since the last flush into the statistics
+   void flush();
+
+   // the queue figures are left for the owner to fill in
+   void snapshot( SDispatchStatsData &data );
+   void reset();
+
+   //
+   // the post time stamp, the low 32 bits of CLOCK_MONOTONIC in
+   // microseconds (never 0, which marks an unstamped message), and the
+   // time elapsed since a stamp
+   //
+   static uint32_t stamp();
+   static uint32_t elapsed( uint32_t stamp ) { return SDispatchStats::stamp() - stamp; }
+
+   // CLOCK_MONOTONIC in nanoseconds
+   static uint64_t now();
+
+private:
+   SDispatchStats( const SDispatchStats & );
+   SDispatchStats &operator=( const SDispatchStats & );
+
+   struct Sample
+   {
+      uint16_t id;
+      bool stamped;
+      uint32_t waitus;
+      uint64_t handlerns;
+   };
+
+   std::atomic<bool> m_enabled;
+   std::vector<Sample> m_pending;
+
+   SMutex m_mutex;
+   uint64_t m_dispatched;
+   std::map<uint16_t,SDispatchIdStats*> m_ids;
+};
+
+#endif // #define __SDISPATCHSTATS_H
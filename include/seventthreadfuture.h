@@ -0,0 +1,182 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SEVENTTHREADFUTURE_H
+#define __SEVENTTHREADFUTURE_H
+
+#include <limits.h>
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "ssync.h"
+
+//
+// The result of an SEventThread::call(), shared by the future and the
+// call message.  The ready word is 0 while pending, 1 once complete and
+// 2 while pending with a waiter asleep on it, so completing a call nobody
+// waits for costs no system call.
+//
+template <class R>
+class SEventThreadCallState
+{
+public:
+   SEventThreadCallState() : m_ready( 0 ), m_hasValue( false ), m_mutex( SMutex::mtNormal ) {}
+
+   ~SEventThreadCallState()
+   {
+      if ( m_hasValue )
+         reinterpret_cast<R*>( &m_value )->~R();
+   }
+
+   bool isReady() { return m_ready.load( std::memory_order_acquire ) == 1; }
+
+   bool wait( const SDeadline &deadline )
+   {
+      while ( true )
+      {
+         int ready = m_ready.load( std::memory_order_acquire );
+
+         if ( ready == 1 )
+            return true;
+         if ( ready == 0 && !m_ready.compare_exchange_weak( ready, 2, std::memory_order_acquire ) )
+            continue;
+
+         if ( deadline.isInfinite() )
+            SFutex::wait( m_ready, 2 );
+         else if ( deadline.isExpired() )
+            return false;
+         else
+            SFutex::waitUntil( m_ready, 2, deadline.getTimespec() );
+      }
+   }
+
+   // the result is stored first, complete() then publishes it
+   template <class T>
+   void setValue( T &&value )
+   {
+      new ( &m_value ) R( std::forward<T>( value ) );
+      m_hasValue = true;
+   }
+
+   void setException( std::exception_ptr error ) { m_error = error; }
+
+   R &getValue()
+   {
+      if ( m_error )
+         std::rethrow_exception( m_error );
+      return *reinterpret_cast<R*>( &m_value );
+   }
+
+   // runs fn once the call is complete, right away if it already is
+   void then( std::function<void()> fn )
+   {
+      {
+         SMutexLock l( m_mutex );
+         if ( !isReady() )
+         {
+            m_then = std::move( fn );
+            return;
+         }
+      }
+
+      fn();
+   }
+
+   // wakes the waiters and runs the continuation, if any
+   void complete()
+   {
+      std::function<void()> then;
+      int ready;
+
+      {
+         SMutexLock l( m_mutex );
+         ready = m_ready.exchange( 1, std::memory_order_release );
+         then.swap( m_then );
+      }
+
+      if ( ready == 2 )
+         SFutex::wake( m_ready, INT_MAX );
+
+      if ( then )
+         then();
+   }
+
+private:
+   std::atomic<int> m_ready;
+   typename std::aligned_storage<sizeof(R), alignof(R)>::type m_value;
+   bool m_hasValue;
+   std::exception_ptr m_error;
+   SMutex m_mutex;
+   std::function<void()> m_then;
+};
+
+// a call without a result only records that it has run
+template <>
+class SEventThreadCallState<void> : public SEventThreadCallState<bool>
+{
+public:
+   void setValue() { SEventThreadCallState<bool>::setValue( true ); }
+   void getValue() { SEventThreadCallState<bool>::getValue(); }
+};
+
+//
+// Handle on the result of SEventThread::call(), cheap to copy.  get()
+// waits for the call and returns its result or rethrows what it threw.
+// wait() gives up after the timeout (milliseconds, -1 waits for ever)
+// and returns whether the call has completed.  then() runs a
+// continuation, in the event thread when the call completes there, or in
+// the caller when it already has.
+//
+template <class R>
+class SEventThreadFuture
+{
+public:
+   SEventThreadFuture() {}
+   SEventThreadFuture( const std::shared_ptr< SEventThreadCallState<R> > &state ) : m_state( state ) {}
+
+   bool isValid() { return m_state.get() != NULL; }
+   bool isReady() { return m_state->isReady(); }
+
+   bool wait( long milliseconds = -1 )
+   {
+      return m_state->wait( milliseconds < 0 ? SDeadline() : SDeadline( milliseconds ) );
+   }
+
+   typename std::add_lvalue_reference<R>::type get()
+   {
+      m_state->wait( SDeadline() );
+      return m_state->getValue();
+   }
+
+   void then( std::function<void(SEventThreadFuture<R>&)> fn )
+   {
+      SEventThreadFuture<R> self( *this );
+      m_state->then( [self, fn]() mutable { fn( self ); } );
+   }
+
+private:
+   std::shared_ptr< SEventThreadCallState<R> > m_state;
+};
+
+#endif // #define __SEVENTTHREADFUTURE_H
@@ -0,0 +1,197 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SEVENTTHREADGROUP_H
+#define __SEVENTTHREADGROUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "serror.h"
+#include "sthread.h"
+
+//
+// N SEventThreads of class T sharing one role.  Messages posted with a key
+// go to the thread picked by a hash of the key, so all the messages for a
+// key (a subscriber, a peer, ...) are dispatched in order by one thread
+// while different keys spread across the threads.  The key needs a
+// std::hash specialization.
+//
+// The group owns the threads.  shutdown() asks every thread to finish its
+// backlog and stop, then joins them in index order.  Nothing may be posted
+// to the group once shutdown() has started.
+//
+template <class T>
+class SEventThreadGroup
+{
+public:
+   SEventThreadGroup() {}
+   ~SEventThreadGroup() { shutdown(); }
+
+   //
+   // the options apply to the threads started by init(), except that
+   // thread i is named "<name>-<i>" and pinned to cpus[i % cpus.size()]
+   //
+   void setOptions( const SThreadOptions &options ) { m_options = options; }
+   const SThreadOptions &getOptions() { return m_options; }
+
+   //
+   // creates and starts count threads, create(i) allocates thread i when
+   // T needs constructor arguments or setup before it starts (initQueue(),
+   // on(), ...)
+   //
+   void init( size_t count, void *arg = NULL )
+   {
+      init( count, arg, []( size_t ) { return new T(); } );
+   }
+
+   template <class F>
+   void init( size_t count, void *arg, F create )
+   {
+      static_assert( std::is_base_of<SEventThread,T>::value, "an SEventThreadGroup holds SEventThreads" );
+
+      if ( !m_threads.empty() )
+         SError::throwRuntimeException( "SEventThreadGroup::init() - the group is already running" );
+      if ( count == 0 )
+         SError::throwRuntimeException( "SEventThreadGroup::init() - a group needs at least one thread" );
+
+      try
+      {
+         for ( size_t i = 0; i < count; i++ )
+         {
+            SThreadOptions options( m_options );
+
+            // thread names are limited to 15 characters
+            if ( !m_options.name.empty() )
+            {
+               char name[16];
+               snprintf( name, sizeof(name), "%s-%u", m_options.name.c_str(), (unsigned int)i );
+               options.name = name;
+            }
+
+            if ( !m_options.cpus.empty() )
+               options.cpus.assign( 1, m_options.cpus[i % m_options.cpus.size()] );
+
+            T *thread = create( i );
+            m_threads.push_back( thread );
+            thread->init( arg, options );
+         }
+      }
+      catch ( ... )
+      {
+         shutdown();
+         throw;
+      }
+   }
+
+   //
+   // with drain each thread dispatches the messages already queued before
+   // it stops, without them are discarded
+   //
+   void shutdown( bool drain = true )
+   {
+      if ( m_threads.empty() )
+         return;
+
+      for ( typename std::vector<T*>::iterator it = m_threads.begin(); it != m_threads.end(); ++it )
+         (*it)->quit( drain );
+
+      for ( typename std::vector<T*>::iterator it = m_threads.begin(); it != m_threads.end(); ++it )
+      {
+         (*it)->join();
+         delete *it;
+      }
+
+      m_threads.clear();
+   }
+
+   size_t getThreadCount() { return m_threads.size(); }
+   T &getThread( size_t index ) { return *m_threads[index]; }
+
+   // index of the thread that handles key
+   template <class K>
+   size_t getIndex( const K &key )
+   {
+      // spread identity hashes (integers) before reducing them to an index
+      uint64_t h = (uint64_t)std::hash<K>()( key ) * 0x9E3779B97F4A7C15ULL;
+      return (size_t)( ( ( h >> 32 ) * m_threads.size() ) >> 32 );
+   }
+
+   template <class K>
+   T &getThreadByKey( const K &key ) { return *m_threads[getIndex( key )]; }
+
+   template <class K>
+   bool postMessage( const K &key, uint16_t message )
+   {
+      return m_threads[getIndex( key )]->postMessage( message );
+   }
+
+   template <class K>
+   bool postMessage( const K &key, SEventThreadMessage *msg )
+   {
+      return m_threads[getIndex( key )]->postMessage( msg );
+   }
+
+   template <class K, class P>
+   bool postInline( const K &key, uint16_t message, const P &payload )
+   {
+      return m_threads[getIndex( key )]->postInline( message, payload );
+   }
+
+   //
+   // post to every thread, returns false if any of them rejected it.
+   // broadcastMessage() posts make(i), a new message, to thread i.
+   //
+   bool broadcast( uint16_t message )
+   {
+      bool ok = true;
+      for ( typename std::vector<T*>::iterator it = m_threads.begin(); it != m_threads.end(); ++it )
+         ok = (*it)->postMessage( message ) && ok;
+      return ok;
+   }
+
+   template <class P>
+   bool broadcastInline( uint16_t message, const P &payload )
+   {
+      bool ok = true;
+      for ( typename std::vector<T*>::iterator it = m_threads.begin(); it != m_threads.end(); ++it )
+         ok = (*it)->postInline( message, payload ) && ok;
+      return ok;
+   }
+
+   template <class F>
+   bool broadcastMessage( F make )
+   {
+      bool ok = true;
+      for ( size_t i = 0; i < m_threads.size(); i++ )
+         ok = m_threads[i]->postMessage( make( i ) ) && ok;
+      return ok;
+   }
+
+private:
+   SEventThreadGroup( const SEventThreadGroup & );
+   SEventThreadGroup &operator=( const SEventThreadGroup & );
+
+   SThreadOptions m_options;
+   std::vector<T*> m_threads;
+};
+
+#endif // #define __SEVENTTHREADGROUP_H
@@ -0,0 +1,146 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SHISTOGRAM_H
+#define __SHISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+//
+// Histogram with power of two buckets.  Bucket 0 counts zero, bucket i
+// counts the values in [2^(i-1), 2^i), the last bucket also counts
+// everything larger.  Adding a value is a couple of instructions so it can
+// be used on hot paths, it is not thread safe, accumulate per thread and
+// merge().
+//
+class SHistogram
+{
+public:
+   static const int BUCKETS = 48;
+
+   SHistogram() { reset(); }
+
+   void reset()
+   {
+      memset( m_buckets, 0, sizeof(m_buckets) );
+      m_count = 0;
+      m_sum = 0;
+      m_max = 0;
+   }
+
+   void add( uint64_t value )
+   {
+      m_buckets[ getBucketIndex( value ) ]++;
+      m_count++;
+      m_sum += value;
+      if ( value > m_max )
+         m_max = value;
+   }
+
+   void merge( const SHistogram &h )
+   {
+      for ( int i = 0; i < BUCKETS; i++ )
+         m_buckets[i] += h.m_buckets[i];
+      m_count += h.m_count;
+      m_sum += h.m_sum;
+      if ( h.m_max > m_max )
+         m_max = h.m_max;
+   }
+
+   uint64_t getCount() const { return m_count; }
+   uint64_t getSum() const { return m_sum; }
+   uint64_t getMax() const { return m_max; }
+   uint64_t getMean() const { return m_count ? m_sum / m_count : 0; }
+   uint64_t getBucket( int i ) const { return m_buckets[i]; }
+
+   //
+   // upper bound of the bucket holding the given fraction (0.0 - 1.0) of
+   // the values, limited to the largest value seen
+   //
+   uint64_t getPercentile( double fraction ) const
+   {
+      if ( m_count == 0 )
+         return 0;
+
+      uint64_t target = (uint64_t)( fraction * m_count );
+      uint64_t seen = 0;
+
+      if ( target == 0 )
+         target = 1;
+
+      for ( int i = 0; i < BUCKETS; i++ )
+      {
+         seen += m_buckets[i];
+         if ( seen >= target )
+            return getBucketLimit( i ) < m_max ? getBucketLimit( i ) : m_max;
+      }
+
+      return m_max;
+   }
+
+   static int getBucketIndex( uint64_t value )
+   {
+      int i = value == 0 ? 0 : 64 - __builtin_clzll( value );
+      return i < BUCKETS ? i : BUCKETS - 1;
+   }
+
+   // largest value counted by bucket i
+   static uint64_t getBucketLimit( int i )
+   {
+      return i == 0 ? 0 : ( i >= 64 ? UINT64_MAX : ( (uint64_t)1 << i ) - 1 );
+   }
+
+   //
+   // {"count":n,"sum":n,"max":n,"mean":n,"p50":n,"p90":n,"p99":n,
+   //  "buckets":[[limit,count],...]}, empty buckets are left out
+   //
+   void serializeJSON( std::string &json ) const
+   {
+      json += "{\"count\":" + std::to_string( m_count );
+      json += ",\"sum\":" + std::to_string( m_sum );
+      json += ",\"max\":" + std::to_string( m_max );
+      json += ",\"mean\":" + std::to_string( getMean() );
+      json += ",\"p50\":" + std::to_string( getPercentile( 0.50 ) );
+      json += ",\"p90\":" + std::to_string( getPercentile( 0.90 ) );
+      json += ",\"p99\":" + std::to_string( getPercentile( 0.99 ) );
+      json += ",\"buckets\":[";
+
+      bool first = true;
+      for ( int i = 0; i < BUCKETS; i++ )
+      {
+         if ( m_buckets[i] == 0 )
+            continue;
+         if ( !first )
+            json += ",";
+         json += "[" + std::to_string( getBucketLimit( i ) ) + "," + std::to_string( m_buckets[i] ) + "]";
+         first = false;
+      }
+
+      json += "]}";
+   }
+
+private:
+   uint64_t m_buckets[BUCKETS];
+   uint64_t m_count;
+   uint64_t m_sum;
+   uint64_t m_max;
+};
+
+#endif // #define __SHISTOGRAM_H
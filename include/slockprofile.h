@@ -0,0 +1,81 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SLOCKPROFILE_H
+#define __SLOCKPROFILE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "shistogram.h"
+
+//
+// Contention profile of the named SMutex objects (see SMutex::init() and
+// SMutex::setName()), all the mutexes sharing a name share a profile.
+//
+// Profiling is off by default.  While it is on, every acquisition of a
+// named mutex records whether the lock was contended and how long the
+// caller waited (nanoseconds), the outermost release records how long the
+// lock was held.  The samples are accumulated per thread and folded into
+// the shared profile every SLOCKPROFILE_FLUSH_COUNT samples, at least once
+// a second while the thread keeps using the lock, and when the thread
+// exits, so a snapshot may lag slightly behind.
+//
+const uint32_t SLOCKPROFILE_FLUSH_COUNT = 256;
+
+class SLockProfile;
+
+struct SLockProfileData
+{
+   std::string name;
+   uint64_t acquisitions;
+   uint64_t contended;
+   SHistogram wait;
+   SHistogram hold;
+};
+
+class SLockProfiler
+{
+public:
+   static void setEnabled( bool enabled );
+   static bool isEnabled();
+
+   // returns the profile for name, created on first use and never freed
+   static SLockProfile *getProfile( const char *name );
+
+   static void recordAcquire( SLockProfile *profile, bool contended, uint64_t waitns );
+   static void recordHold( SLockProfile *profile, uint64_t holdns );
+
+   // folds the samples accumulated by the calling thread into the profiles
+   static void flush();
+
+   static void snapshot( std::vector<SLockProfileData> &profiles );
+   static void reset();
+
+   //
+   // {"enabled":true,"locks":[{"name":"...","acquisitions":n,"contended":n,
+   //  "wait_ns":{...},"hold_ns":{...}},...]}, sorted by contended count
+   //
+   static void serializeJSON( std::string &json );
+
+   // CLOCK_MONOTONIC in nanoseconds
+   static uint64_t now();
+};
+
+#endif // #define __SLOCKPROFILE_H
@@ -0,0 +1,47 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SPOOL_H
+#define __SPOOL_H
+
+#include <stddef.h>
+
+//
+// Size-class allocator for small objects that are allocated on one thread
+// and freed on another, such as the messages posted to an SEventThread.
+//
+// Each thread allocates from its own cache without locking.  A block freed
+// by its owning thread goes straight back on that thread's free list, a
+// block freed by any other thread is pushed on a lock-free return stack
+// that the owner collects when its free list runs dry.  The cache of a
+// thread that exits is handed to the next thread that starts, so the
+// blocks it owns are not lost.  Requests larger than the largest size
+// class, or made while the pool is disabled, fall through to the heap.
+//
+class SMessagePool
+{
+public:
+   static void *allocate( size_t size );
+   static void release( void *ptr );
+
+   static void setEnabled( bool enabled );
+   static bool isEnabled();
+
+   static size_t getMaxPooledSize();
+};
+
+#endif // #define __SPOOL_H
@@ -17,9 +17,21 @@
 #ifndef __SQUEUE_H
 #define __SQUEUE_H
 
+#include <string.h>
+
 #include <queue>
+#include <vector>
+#include <atomic>
+#include <type_traits>
 
 #include "ssync.h"
+#include "spool.h"
+
+const size_t SQUEUE_DEFAULT_RING_CAPACITY = 65536;
+const size_t SQUEUE_MAX_LANES = 32;
+
+// bytes of payload a message posted by value can carry, see SQueueEntry
+const size_t SQUEUE_INLINE_SIZE = 48;
 
 class SQueueMessage
 {
@@ -30,27 +42,314 @@ public:
    uint16_t getId() { return m_id; }
    uint16_t setId( uint16_t id ) { return m_id = id; }
 
+   //
+   // messages, including every derived class, come from SMessagePool since
+   // they are typically created on one thread and deleted on another
+   //
+   static void *operator new( size_t size ) { return SMessagePool::allocate( size ); }
+   static void operator delete( void *ptr ) { SMessagePool::release( ptr ); }
+
+   //
+   // messages posted by value (see SQueueEntry) are delivered as a message
+   // whose payload is read with as<T>(), T must be the type that was posted
+   //
+   virtual const void *getPayload() { return NULL; }
+   virtual size_t getPayloadSize() { return 0; }
+   bool isInline() { return getPayload() != NULL; }
+
+   template<class T>
+   const T &as()
+   {
+      static_assert( std::is_trivially_copyable<T>::value, "inline payloads must be trivially copyable" );
+      static_assert( sizeof(T) <= SQUEUE_INLINE_SIZE, "inline payload too large" );
+
+      if ( getPayloadSize() != sizeof(T) || !isInline() )
+         payloadMismatch( sizeof(T) );
+
+      return *static_cast<const T*>( getPayload() );
+   }
+
 private:
    SQueueMessage();
+   void payloadMismatch( size_t size );
 
    uint16_t m_id;
 };
 
+//
+// Element stored by the queue, 64 bytes.  Either a heap message or a
+// message id plus up to SQUEUE_INLINE_SIZE bytes of payload copied by
+// value, which needs no allocation and no virtual destructor.  A ring
+// cell adds its sequence number, so entries are not cache line aligned
+// there, pushing and popping copy only the part of the payload in use.
+//
+struct SQueueEntry
+{
+   SQueueMessage *msg;
+   uint16_t id;
+   uint16_t size;
+   uint32_t stamp;     // free for the owner, see SEventThread::setDispatchStats()
+   uint64_t payload[SQUEUE_INLINE_SIZE / sizeof(uint64_t)];
+
+   void set( SQueueMessage *m )
+   {
+      msg = m;
+      id = m->getId();
+      size = 0;
+      stamp = 0;
+   }
+
+   void set( uint16_t msgid, const void *data = NULL, size_t len = 0 )
+   {
+      msg = NULL;
+      id = msgid;
+      size = len;
+      stamp = 0;
+      if ( len > 0 )
+         memcpy( payload, data, len );
+   }
+
+   template<class T>
+   void set( uint16_t msgid, const T &data )
+   {
+      static_assert( std::is_trivially_copyable<T>::value, "inline payloads must be trivially copyable" );
+      static_assert( sizeof(T) <= SQUEUE_INLINE_SIZE, "inline payload too large" );
+      static_assert( alignof(T) <= alignof(uint64_t), "inline payload is over aligned" );
+
+      set( msgid, &data, sizeof(T) );
+   }
+
+   // deletes the heap message, if any
+   void discard() { delete msg; msg = NULL; }
+};
+
+//
+// SQueue::pop() returns inline entries as one of these, it owns a copy of
+// the payload
+//
+class SQueueInlineMessage : public SQueueMessage
+{
+public:
+   SQueueInlineMessage( const SQueueEntry &entry )
+      : SQueueMessage( entry.id ),
+        m_size( entry.size )
+   {
+      memcpy( m_payload, entry.payload, entry.size );
+   }
+
+   const void *getPayload() { return m_payload; }
+   size_t getPayloadSize() { return m_size; }
+
+private:
+   size_t m_size;
+   uint64_t m_payload[SQUEUE_INLINE_SIZE / sizeof(uint64_t)];
+};
+
+//
+// Bounded lock-free ring of queue entries.  Any number of threads may
+// push, the sequence numbers stored in each cell also make pop safe from
+// more than one thread, but SQueue only parks a single consumer.
+//
+class SQueueRing
+{
+public:
+   SQueueRing( size_t capacity );
+   ~SQueueRing();
+
+   bool push( const SQueueEntry &entry );
+   bool pop( SQueueEntry &entry );
+
+   size_t getCapacity() { return m_mask + 1; }
+   size_t getSize();
+
+private:
+   SQueueRing();
+
+   struct Cell
+   {
+      std::atomic<size_t> seq;
+      SQueueEntry entry;
+   };
+
+   Cell *m_cells;
+   size_t m_mask;
+
+   // keep the producer and consumer indexes on separate cache lines
+   char m_pad1[64];
+   std::atomic<size_t> m_head;
+   char m_pad2[64 - sizeof(std::atomic<size_t>)];
+   std::atomic<size_t> m_tail;
+   char m_pad3[64 - sizeof(std::atomic<size_t>)];
+};
+
 class SQueue
 {
 public:
+   enum QueueType
+   {
+      qtLocked,   // std::queue protected by a mutex
+      qtRing      // lock-free bounded ring, multiple producers/single consumer
+   };
+
+   //
+   // what push() does when the queue is at capacity
+   //
+   enum OverflowPolicy
+   {
+      opBlock,       // wait for space (push(msg, false) returns false)
+      opFailFast,    // return false, the caller keeps the message
+      opDropOldest,  // delete the oldest queued message to make room
+      opDropNewest   // delete the message being pushed and return true
+   };
+
    SQueue();
+   SQueue( QueueType type, size_t capacity = 0, OverflowPolicy policy = opBlock );
    ~SQueue();
 
+   //
+   // must be called while the queue is empty, a capacity of zero means
+   // unbounded for qtLocked and SQUEUE_DEFAULT_RING_CAPACITY for qtRing
+   //
+   void init( QueueType type, size_t capacity = 0, OverflowPolicy policy = opBlock );
+   QueueType getType() { return m_type; }
+
+   //
+   // Priority lanes, lane 0 has the lowest priority and is the one push()
+   // uses, the highest lane is always serviced first.  Each lane has its
+   // own capacity.  setLanes() must be called while the queue is empty.
+   //
+   // With a starvation limit of N, after N consecutive messages have been
+   // taken from lanes above lane 0 the lowest non-empty lane is serviced
+   // once.  Zero (the default) means strict priority.
+   //
+   void setLanes( size_t lanes );
+   size_t getLanes() { return m_lanecount; }
+   void setStarvationLimit( size_t limit ) { m_starvationLimit = limit; }
+   size_t getStarvationLimit() { return m_starvationLimit; }
+
+   void setOverflowPolicy( OverflowPolicy policy ) { m_policy = policy; }
+   OverflowPolicy getOverflowPolicy() { return m_policy; }
+   size_t getCapacity();
+
+   //
+   // push( msgid ) queues the id by value, nothing is allocated
+   //
    bool push( uint16_t msgid, bool wait = true );
    bool push( SQueueMessage *msg, bool wait = true );
+   bool push( const SQueueEntry &entry, bool wait = true );
+   bool pushLane( SQueueMessage *msg, size_t lane, bool wait = true );
+   bool pushLane( const SQueueEntry &entry, size_t lane, bool wait = true );
+
+   template<class T>
+   bool pushInline( uint16_t msgid, const T &data, bool wait = true )
+   {
+      SQueueEntry e;
+      e.set( msgid, data );
+      return push( e, wait );
+   }
+
+   //
+   // queues the message on the control list, which is unbounded and taken
+   // ahead of every lane.  The capacity, the overflow policy and the
+   // starvation limit do not apply to it, so an urgent message is never
+   // dropped or evicted and pushUrgent() never blocks.
+   //
+   bool pushUrgent( SQueueMessage *msg );
+   bool pushUrgent( const SQueueEntry &entry );
 
+   //
+   // pop( false ) only checks for a message, the deadline versions wait
+   // until the deadline (CLOCK_MONOTONIC) and return NULL on timeout
+   //
+   // The SQueueMessage versions return inline entries as a newly allocated
+   // SQueueInlineMessage, consumers that want to avoid the allocation pop
+   // SQueueEntry objects instead.
+   //
    SQueueMessage *pop( bool wait = true );
+   SQueueMessage *pop( const SDeadline &deadline );
+   SQueueMessage *timedPop( long milliseconds );
+   bool pop( SQueueEntry &entry, const SDeadline &deadline );
+
+   //
+   // batch variants take the lock (or wake the consumer) once per call
+   // and return the number of messages transferred, popBatch() only
+   // waits for the first message
+   //
+   size_t pushBatch( SQueueMessage **msgs, size_t count, bool wait = true );
+   size_t pushBatch( const SQueueEntry *entries, size_t count, bool wait = true );
+   size_t popBatch( SQueueMessage **msgs, size_t max, bool wait = true );
+   size_t popBatch( SQueueMessage **msgs, size_t max, const SDeadline &deadline );
+   size_t popBatch( SQueueEntry *entries, size_t max, const SDeadline &deadline );
+
+   size_t getSize();
+
+   //
+   // Wakes a consumer that sleeps outside the queue, in epoll_wait() for
+   // instance, through an eventfd.  The consumer calls armNotify() before
+   // it goes to sleep, which returns false if a message is already queued.
+   // The first push that finds the queue armed disarms it and writes 1 to
+   // the eventfd.  The consumer calls disarmNotify() once it is awake.
+   //
+   void setNotifyFd( int fd ) { m_notifyfd = fd; }
+   int getNotifyFd() { return m_notifyfd; }
+   bool armNotify();
+   void disarmNotify() { m_notifyArmed.store( 0, std::memory_order_relaxed ); }
+
+   size_t getHighWaterMark() { return m_highwater.load( std::memory_order_relaxed ); }
+   void resetHighWaterMark() { m_highwater.store( 0, std::memory_order_relaxed ); }
+   uint64_t getDropped() { return m_dropped.load( std::memory_order_relaxed ); }
 
 private:
+   enum EnqueueResult
+   {
+      erQueued,
+      erFull,
+      erRejected
+   };
+
+   void allocateLanes();
+   void freeLanes();
+   bool isEmpty();
+   size_t getLaneSize( size_t lane );
+
+   EnqueueResult enqueueLocked( const SQueueEntry &entry, size_t lane );
+   bool pushLocked( const SQueueEntry &entry, size_t lane, bool wait );
+   bool pushRing( const SQueueEntry &entry, size_t lane, bool wait );
+   bool take( SQueueEntry &entry, size_t &lane );
+   bool takeControl( SQueueEntry &entry );
+   bool popRing( SQueueEntry &entry, const SDeadline &deadline, size_t &lane );
+   void waitForSpace( int seq );
+   void wakeConsumer();
+   void notifyConsumer();
+   void releaseProducers( size_t lane );
+   void updateHighWaterMark();
+
+   QueueType m_type;
+   OverflowPolicy m_policy;
+   size_t m_capacity;
+   size_t m_lanecount;
+   size_t m_starvationLimit;
+   size_t m_consecutive;               // consumer side, see take()
+
    SMutex m_mutex;
    SSemaphore m_sem;
-   std::queue<SQueueMessage*> m_queue;
+   std::vector< std::queue<SQueueEntry> > m_queues;
+
+   SMutex m_controlMutex;
+   std::queue<SQueueEntry> m_control;  // see pushUrgent()
+   std::atomic<size_t> m_controlCount;
+
+   std::vector<SQueueRing*> m_rings;
+   std::atomic<int> m_ringParked;      // 1 while the consumer waits for a message
+
+   int m_notifyfd;                     // eventfd written by notifyConsumer(), -1 for none
+   std::atomic<int> m_notifyArmed;     // 1 while the consumer sleeps outside the queue
+
+   std::atomic<int> m_spaceSeq;        // bumped when space frees up for waiting producers
+   std::atomic<int> m_spaceWaiters;    // producers waiting for space
+
+   std::atomic<size_t> m_highwater;
+   std::atomic<uint64_t> m_dropped;
 };
 
 #endif // #define __SQUEUE_H
@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __SSHMQUEUE_H
+#define __SSHMQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#include "ssync.h"
+
+struct SShmQueueHeader;
+
+//
+// Multi-producer, multi-consumer message queue between processes on the
+// same host.  The queue is a ring of fixed size slots in a named POSIX
+// shared memory segment (shm_open), a message is a 16 bit id plus up to
+// getSlotSize() bytes of payload that is copied straight into the slot.
+//
+// The ring is guarded by a robust process-shared mutex and waiters sleep
+// on shared futexes, so a process that dies at any point cannot wedge the
+// queue:
+//
+//    - a message only becomes visible (or is only removed) once it has
+//      been copied completely, a producer that dies part way through a
+//      push leaves nothing behind and a message whose consumer died part
+//      way through a pop is delivered again
+//    - the next process to lock the mutex after its owner died marks it
+//      consistent and carries on, getRecoveries() counts these
+//    - if the process that created the segment dies while initializing
+//      it, the next process to call init() initializes it again
+//
+class SShmQueue
+{
+public:
+   SShmQueue();
+   ~SShmQueue();
+
+   //
+   // creates the segment or attaches to an existing segment, which must
+   // have the same slot count and slot size
+   //
+   void init( const char *name, uint32_t slotCount, uint32_t slotSize );
+
+   //
+   // attaches to a segment created by another process, waiting up to
+   // milliseconds for the creator to finish initializing it
+   //
+   void attach( const char *name, long milliseconds = 5000 );
+
+   // unmaps the segment, the segment itself lives on until unlink()
+   void close();
+   static void unlink( const char *name );
+
+   bool isOpen() { return m_hdr != NULL; }
+
+   //
+   // push() copies len bytes of data into the queue, pop() copies the next
+   // message into data and sets msgid and len (len must be set to the size
+   // of the buffer on input).  Both return false if the queue stays full
+   // (empty) until the deadline.
+   //
+   bool push( uint16_t msgid, const void *data, size_t len, bool wait = true );
+   bool push( uint16_t msgid, const void *data, size_t len, const SDeadline &deadline );
+   bool pop( uint16_t &msgid, void *data, size_t &len, bool wait = true );
+   bool pop( uint16_t &msgid, void *data, size_t &len, const SDeadline &deadline );
+
+   const std::string &getName() { return m_name; }
+   uint32_t getCapacity();
+   uint32_t getSlotSize();
+   size_t getSize();
+   uint64_t getRecoveries();
+
+private:
+   void map( int fd, size_t size );
+   void lock();
+   void unlock();
+   char *getSlot( uint64_t pos );
+
+   std::string m_name;
+   SShmQueueHeader *m_hdr;
+   size_t m_mapsize;
+};
+
+#endif // #define __SSHMQUEUE_H
@@ -23,6 +23,7 @@
 #include <map>
 #include <functional>
 #include <memory>
+#include <vector>
 
 #include "sthread.h"
 #include "ssyslog.h"
@@ -102,8 +103,26 @@ private:
    std::string m_name;
 };
 
+//
+// registerStatResult() and registerStatAttemp() post these by value, the
+// SStats handlers turn them back into a StatResultMessage or
+// StatAttempMessage on the stack before calling dispatchDerived()
+//
+struct StatResultData {
+   StatType type;
+   uint32_t vendor;
+   uint32_t code;
+};
+
+struct StatAttempData {
+   StatType type;
+   StatAttempType attempType;
+};
+
 class StatResultMessage : public SEventThreadMessage {
 public:
+   static const uint16_t MessageId = STAT_RSLT_MSG;
+
    StatResultMessage( StatType type, uint32_t vendor ,uint32_t code)
       : SEventThreadMessage( STAT_RSLT_MSG ),
         m_type(type),
@@ -123,6 +142,8 @@ private:
 
 class StatAttempMessage : public SEventThreadMessage {
 public:
+   static const uint16_t MessageId = STAT_ATTEMPT_MSG;
+
    StatAttempMessage( StatType type, StatAttempType attempType)
       : SEventThreadMessage( STAT_ATTEMPT_MSG ),
         m_type(type),
@@ -158,6 +179,8 @@ public:
 class UpdateStatInterval : public SEventThreadMessage
 {
 public:
+   static const uint16_t MessageId = STAT_UPDATE_INTERVAL;
+
    UpdateStatInterval( long interval )
       : SEventThreadMessage( STAT_UPDATE_INTERVAL ),
         m_interval(interval) {
@@ -170,9 +193,22 @@ private:
 };
 
 
+//
+// what SStats::getLive() hands to dispatchDerived(), the handler fills in
+// the statistics with setlivestats().  getLive() returns once the handler
+// does.  The constructor taking an SEvent is deprecated and only kept for
+// code that still builds a StatLive itself, set() signals that event.
+//
 class StatLive : public SEventThreadMessage
 {
 public:
+   static const uint16_t MessageId = STAT_GET_LIVE;
+
+   StatLive(std::shared_ptr<std::string> livestats)
+      : SEventThreadMessage( STAT_GET_LIVE ),
+        m_livestats(livestats)
+   {
+   }
    StatLive(std::shared_ptr<SEvent> event,
             std::shared_ptr<std::string> livestats)
       : SEventThreadMessage( STAT_GET_LIVE ),
@@ -180,7 +216,7 @@ public:
         m_livestats(livestats)
    {
    }
-   void set() { m_event->set(); }
+   void set() { if (m_event) m_event->set(); }
    std::shared_ptr<std::string> getlivestats() { return m_livestats; }
    void setlivestats(const std::string& livestats) { *m_livestats = livestats; }
    void setlivestats(const char* livestats) { m_livestats->assign(livestats); }
@@ -215,6 +251,15 @@ public :
    long getInterval() { return m_interval; }
    void updateInterval (long interval);
    void setStatLogger(SLogger* statlogger) { m_statlogger = statlogger; }
+
+   //
+   // the dispatch statistics of these threads (see
+   // SEventThread::setDispatchStats()) are written to the stat logger after
+   // every consolidated period, one JSON line per thread.  The figures are
+   // cumulative, SEventThread::resetDispatchStats() starts them over.
+   //
+   void addDispatchStats(SEventThread *thread);
+   void removeDispatchStats(SEventThread *thread);
    std::shared_ptr<std::string> getLive();
    void dispatch( SEventThreadMessage &msg );
    virtual void getConsolidatedPeriodStat(std::map<std::string, std::string>& keyValues) {};
@@ -230,6 +275,11 @@ public :
 private:
 
    void addGenerationTimeStamp(std::map<std::string, std::string>& keyValues);
+   void handleConsolidate(SEventThreadMessage &msg);
+   void handleInterval(UpdateStatInterval &msg);
+   void handleResult(const StatResultData &data);
+   void handleAttemp(const StatAttempData &data);
+   void logDispatchStats();
 
    long m_interval;
    SEventThread::Timer m_idletimer;
@@ -240,6 +290,9 @@ private:
    StatSerializationMode m_serializ_mode;
 
    SLogger* m_statlogger;
+
+   SMutex m_dstatsMutex;
+   std::vector<SEventThread*> m_dstatsThreads;
 };
 
 
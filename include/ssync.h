@@ -20,34 +20,133 @@
 #include <stdint.h>
 
 #include <string>
+#include <vector>
 #include <stdexcept>
+#include <atomic>
 
-#include <semaphore.h>
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Absolute point in time on CLOCK_MONOTONIC used by the timed waits.  A
+// default constructed deadline never expires, a deadline of zero or fewer
+// milliseconds has already expired and turns a wait into a single try.
+//
+class SDeadline
+{
+public:
+    SDeadline() : mKind(dkInfinite) { mTime.tv_sec = 0; mTime.tv_nsec = 0; }
+    explicit SDeadline(long milliseconds);
+    SDeadline(const struct timespec &monotonic) : mKind(dkAbsolute), mTime(monotonic) {}
+
+    static SDeadline fromNow(long milliseconds) { return SDeadline(milliseconds); }
+    static SDeadline infinite() { return SDeadline(); }
+
+    bool isInfinite() const { return mKind == dkInfinite; }
+    bool isExpired() const;
+
+    // milliseconds until the deadline, -1 if it never expires
+    long remaining() const;
+
+    const struct timespec &getTimespec() const { return mTime; }
+
+private:
+    enum Kind { dkInfinite, dkExpired, dkAbsolute };
+
+    Kind mKind;
+    struct timespec mTime;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class SFutex
+{
+public:
+    // blocks while word == expected, returns false if the wait was
+    // interrupted or the value had already changed
+    static bool wait(std::atomic<int> &word, int expected, bool shared = false);
+    // same as wait() but gives up at deadline (CLOCK_MONOTONIC), returns
+    // false on timeout
+    static bool waitUntil(std::atomic<int> &word, int expected, const struct timespec &deadline, bool shared = false);
+    // wakes up to count waiters blocked on word, returns the number woken
+    static int wake(std::atomic<int> &word, int count = 1, bool shared = false);
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 class SMutexLock;
+class SLockProfile;
+
+const int SMUTEX_DEFAULT_SPIN_COUNT = 100;
 
 class SMutex
 {
    friend SMutexLock;
 
 public:
+    enum MutexType
+    {
+        mtNormal,
+        mtRecursive,
+        mtErrorCheck
+    };
 
+    // recursive and process shared
     SMutex(bool bInit = true);
+
+    //
+    // a spin count greater than zero makes enter() retry the lock that many
+    // times before sleeping in the kernel (ignored on a single CPU)
+    //
+    SMutex(MutexType type, bool processShared = false, int spinCount = 0, bool bInit = true);
     ~SMutex();
 
+    //
+    // a name enables lock profiling for this mutex, see slockprofile.h,
+    // the profile is local to the process that named the mutex
+    //
     void init(const char *pName);
     void destroy();
 
+    void setName(const char *pName);
+
+    // the attributes only take effect on the next init()
+    void setType(MutexType type) { mType = type; }
+    void setProcessShared(bool processShared) { mProcessShared = processShared; }
+    void setSpinCount(int spinCount) { mSpinCount = spinCount; }
+
+    MutexType getType() { return mType; }
+    bool isProcessShared() { return mProcessShared; }
+    int getSpinCount() { return mSpinCount; }
+
 protected:
+    // enter(false) only tries the lock, the deadline version returns false
+    // if the lock could not be acquired in time
     bool enter(bool wait = true);
+    bool enter(const SDeadline &deadline);
     void leave();
 
 private:
+    bool lock(const SDeadline &deadline);
+
     pthread_mutex_t mMutex;
     bool mInitialized;
+
+    MutexType mType;
+    bool mProcessShared;
+    int mSpinCount;
+
+    // only touched while the mutex is held
+    SLockProfile *mProfile;
+    int mProfileDepth;
+    uint64_t mAcquiredAt;
 };
 
 class SMutexLock
@@ -74,6 +173,14 @@ public:
         return mAcquire;
     }
 
+    bool acquire(const SDeadline &deadline)
+    {
+        if (!mAcquire)
+            mAcquire = mMutex.enter(deadline);
+
+        return mAcquire;
+    }
+
 private:
     bool mAcquire;
     SMutex &mMutex;
@@ -82,6 +189,157 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+class SReadLock;
+class SWriteLock;
+
+//
+// Reader-writer lock for read-mostly tables.  Waiting writers are preferred
+// so a steady stream of readers cannot starve them.
+//
+class SRWLock
+{
+   friend SReadLock;
+   friend SWriteLock;
+
+public:
+    SRWLock(bool bInit = true);
+    ~SRWLock();
+
+    void init();
+    void destroy();
+
+protected:
+    bool enterRead(bool wait = true);
+    bool enterWrite(bool wait = true);
+    void leave();
+
+private:
+    pthread_rwlock_t mLock;
+    bool mInitialized;
+};
+
+class SReadLock
+{
+public:
+    SReadLock(SRWLock &lck, bool acq = true)
+        : mAcquire(acq), mLock(lck)
+    {
+        if (mAcquire)
+            mLock.enterRead();
+    }
+
+    ~SReadLock()
+    {
+        if (mAcquire)
+            mLock.leave();
+    }
+
+    bool acquire(bool wait = true)
+    {
+        if (!mAcquire)
+            mAcquire = mLock.enterRead(wait);
+
+        return mAcquire;
+    }
+
+private:
+    bool mAcquire;
+    SRWLock &mLock;
+};
+
+class SWriteLock
+{
+public:
+    SWriteLock(SRWLock &lck, bool acq = true)
+        : mAcquire(acq), mLock(lck)
+    {
+        if (mAcquire)
+            mLock.enterWrite();
+    }
+
+    ~SWriteLock()
+    {
+        if (mAcquire)
+            mLock.leave();
+    }
+
+    bool acquire(bool wait = true)
+    {
+        if (!mAcquire)
+            mAcquire = mLock.enterWrite(wait);
+
+        return mAcquire;
+    }
+
+private:
+    bool mAcquire;
+    SRWLock &mLock;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Sequence lock for a small trivially copyable value.  Readers never block
+// a writer, they copy the value and retry if a write overlapped the copy.
+// Writers are serialized with each other.
+//
+template <class T>
+class SSeqLock
+{
+public:
+    SSeqLock()
+        : mMutex(SMutex::mtNormal), mSeq(0), mValue()
+    {
+    }
+
+    SSeqLock(const T &value)
+        : mMutex(SMutex::mtNormal), mSeq(0), mValue(value)
+    {
+    }
+
+    T read()
+    {
+        T value;
+
+        while (true)
+        {
+            unsigned int seq = mSeq.load(std::memory_order_acquire);
+
+            if ((seq & 1) == 0)
+            {
+                memcpy(&value, &mValue, sizeof(T));
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (mSeq.load(std::memory_order_relaxed) == seq)
+                    return value;
+            }
+
+            sched_yield();
+        }
+    }
+
+    void write(const T &value)
+    {
+        SMutexLock l(mMutex);
+
+        mSeq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        memcpy(&mValue, &value, sizeof(T));
+
+        mSeq.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    SMutex mMutex;
+    std::atomic<unsigned int> mSeq;
+    T mValue;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 class SSemaphore
 {
 public:
@@ -90,25 +348,39 @@ public:
 
     ~SSemaphore();
 
+    //
+    // a max count of zero means the count is only limited by INT_MAX, a
+    // name makes the semaphore process shared (the object itself must
+    // then be in shared memory)
+    //
     void init(unsigned int lInitialCount, unsigned int lMaxCount, const char *szName = NULL);
     void destroy();
 
     bool decrement(bool wait = true);
+    bool decrement(const SDeadline &deadline);
+    bool tryDecrement() { return decrement(false); }
+    bool timedDecrement(long milliseconds) { return decrement(SDeadline(milliseconds)); }
+
+    // returns false if the count is already at the max count
     bool increment();
 
     int getInitialCount() { return mInitialCount; }
     int getMaxCount() { return mMaxCount; }
+    int getValue() { return mValue.load(std::memory_order_relaxed); }
     std::string &getName() { return mName; }
 
 private:
+    bool tryAcquire();
+
     bool mInitialized;
-    unsigned int mCurrCount;
+    bool mShared;
 
     unsigned int mInitialCount;
     unsigned int mMaxCount;
     std::string mName;
 
-    sem_t mSem;
+    std::atomic<int> mValue;
+    std::atomic<int> mWaiters;
 };
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -126,11 +398,23 @@ public:
 
    bool isSet() { return wait(0); }
 
+   // readable while the event is set, can be added to a poll/epoll set
+   int getFd() { return m_fd; }
+
+   //
+   // waitAny() returns the index of a set event or -1 on timeout, waitAll()
+   // returns true once every event has been observed set.  Neither resets
+   // the events.
+   //
+   static int waitAny( SEvent **events, size_t count, int ms = -1 );
+   static int waitAny( std::vector<SEvent*> &events, int ms = -1 ) { return waitAny( events.data(), events.size(), ms ); }
+   static bool waitAll( SEvent **events, size_t count, int ms = -1 );
+   static bool waitAll( std::vector<SEvent*> &events, int ms = -1 ) { return waitAll( events.data(), events.size(), ms ); }
+
 private:
-   void closepipe();
+   void closefd();
 
-   int m_pipefd[2];
-   char m_buf[1];
+   int m_fd;
 };
 
 //////////////////////////////////////////////////////////////////////////////////
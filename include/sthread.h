@@ -18,9 +18,53 @@
 #define __STHREAD_H
 
 #include <signal.h>
+#include <sched.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include "ssync.h"
 #include "squeue.h"
+#include "satomic.h"
+#include "stimerwheel.h"
+#include "sdispatchstats.h"
+#include "seventthreadfuture.h"
+
+class STime;
+
+//
+// How SThread::init() creates the thread.  The defaults match a plain
+// pthread_create() call: unnamed, inherits the creator's CPU mask and
+// scheduling, default stack, no memory policy.
+//
+struct SThreadOptions
+{
+   SThreadOptions()
+      : policy( SCHED_OTHER ),
+        priority( 0 ),
+        stackSize( 0 ),
+        numaNode( -1 )
+   {
+   }
+
+   // thread name, truncated to the 15 characters the kernel keeps
+   std::string name;
+   // CPUs the thread may run on, empty to inherit the creator's mask
+   std::vector<int> cpus;
+   // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or SCHED_RR, the
+   // priority only applies to SCHED_FIFO and SCHED_RR
+   int policy;
+   int priority;
+   // bytes, 0 for the default
+   size_t stackSize;
+   // NUMA node the thread's memory is bound to, -1 for the default policy
+   int numaNode;
+};
 
 class SThread
 {
@@ -38,7 +82,12 @@ public:
    virtual unsigned long threadProc(void *arg) = 0;
 
    void init(void *arg, bool suspended = false);
+   void init(void *arg, const SThreadOptions &options, bool suspended = false);
    void resume();
+
+   // must be called before init() to take effect
+   void setOptions(const SThreadOptions &options) { mOptions = options; }
+   const SThreadOptions &getOptions() { return mOptions; }
    void join();
 
    static void sleep(int milliseconds);
@@ -74,33 +123,76 @@ public:
 
 protected:
 
+   //
+   // suspend() asks the thread to stop and returns once it has parked
+   // itself in _suspend() (or if it is not running), it is up to the
+   // thread to call _suspend() when asked, SEventThread does so when it
+   // dispatches ETM_SUSPEND.  Suspensions nest, the thread carries on
+   // once resume() has been called as many times.
+   //
    virtual void suspend();
    void _suspend();
 
+   //
+   // suspend() in two steps for a thread that has to be told to park:
+   // beginSuspend() counts the suspension and returns true if the thread
+   // has to park, waitSuspended() then waits until it has
+   //
+   bool beginSuspend();
+   void waitSuspended();
+
 private:
+   //
+   // where the thread itself is in its life, independent of the RunState
+   // an application may manage by hand.  Every change bumps mLifecycleSeq
+   // and wakes whoever waits on it.
+   //
+   enum Lifecycle
+   {
+    lcIdle,        // not created yet
+    lcParked,      // waiting for the suspend count to reach zero
+    lcRunning,
+    lcFinished     // threadProc() has returned
+   };
+
    bool mSelfDestruct;
    bool mInitialized;
+   bool mJoined;
    pthread_t mThread;
    static void *_threadProc(void *arg);
    void _shutdown();
+   void applyOptions();
+
+   void park();
+   void setRunning();
+   void setLifecycle(Lifecycle lc);
+   template <class P> void waitLifecycle(P done);
+   template <class P, class A> void waitLifecycle(P done, A then);
 
    SMutex mMutex;
    RunState mState;
    bool mKeepGoing;
    bool mUpdateStateManually;
-   SSemaphore mSuspended;
-   SSemaphore mSuspendSem;
+   Lifecycle mLifecycle;
+   std::atomic<int> mLifecycleSeq;
    int mSuspendCnt;
    void *mArg;
    unsigned long mExitCode;
+   SThreadOptions mOptions;
 };
 
 const uint16_t ETM_INIT    = 1;
 const uint16_t ETM_QUIT    = 2;
 const uint16_t ETM_SUSPEND = 3;
 const uint16_t ETM_TIMER   = 4;
+const uint16_t ETM_WAKEUP  = 5;
+const uint16_t ETM_DRAIN   = 6;
+const uint16_t ETM_CALL    = 7;
 const uint16_t ETM_USER    = 10000;
 
+const size_t SEVENTTHREAD_DEFAULT_BATCH_SIZE = 64;
+const int SEVENTTHREAD_EPOLL_EVENTS = 64;
+
 class SEventThreadMessage : public SQueueMessage
 {
 public:
@@ -108,6 +200,82 @@ public:
    virtual ~SEventThreadMessage() { }
 };
 
+//
+// how a message posted by value is handed to dispatch(), it only lives for
+// the duration of the call and refers to the queue entry's payload
+//
+class SEventThreadInlineMessage : public SEventThreadMessage
+{
+public:
+   SEventThreadInlineMessage( const SQueueEntry &entry )
+      : SEventThreadMessage( entry.id ),
+        m_entry( entry )
+   {
+   }
+
+   const void *getPayload() { return m_entry.payload; }
+   size_t getPayloadSize() { return m_entry.size; }
+
+private:
+   const SQueueEntry &m_entry;
+};
+
+//
+// carries a function posted with SEventThread::call() and completes its
+// future, with an error if the message is deleted without being run
+//
+class SEventThreadCallMessage : public SEventThreadMessage
+{
+public:
+   SEventThreadCallMessage() : SEventThreadMessage( ETM_CALL ) {}
+   virtual void run() = 0;
+};
+
+template <class F, class R>
+class SEventThreadCall : public SEventThreadCallMessage
+{
+public:
+   SEventThreadCall( F &&fn, const std::shared_ptr< SEventThreadCallState<R> > &state )
+      : m_fn( std::move(fn) ), m_state( state ), m_ran( false )
+   {
+   }
+
+   ~SEventThreadCall()
+   {
+      if ( !m_ran )
+      {
+         m_state->setException( std::make_exception_ptr(
+            std::runtime_error( "SEventThread::call() - the call was discarded" ) ) );
+         m_state->complete();
+      }
+   }
+
+   // an exception thrown by a continuation propagates to the caller
+   void run()
+   {
+      m_ran = true;
+
+      try
+      {
+         invoke( std::is_void<R>() );
+      }
+      catch ( ... )
+      {
+         m_state->setException( std::current_exception() );
+      }
+
+      m_state->complete();
+   }
+
+private:
+   void invoke( std::true_type ) { m_fn(); m_state->setValue(); }
+   void invoke( std::false_type ) { m_state->setValue( m_fn() ); }
+
+   F m_fn;
+   std::shared_ptr< SEventThreadCallState<R> > m_state;
+   bool m_ran;
+};
+
 class SEventThread : public SThread
 {
 public:
@@ -115,7 +283,16 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
-   class Timer
+   //
+   // A timer on the SEventThread's timer wheel, onTimer() is called from
+   // the thread's dispatch loop when it expires.  start() and stop() may be
+   // called from any thread.  Called from another thread, stop() (and so
+   // destroy() and the destructor) waits for an onTimer() of this timer
+   // that is in progress, so it must not be called with a lock onTimer()
+   // takes held.  A timer must be destroyed before the thread it was
+   // initialized with.
+   //
+   class Timer : private STimerWheelNode
    {
       friend class SEventThread;
 
@@ -136,16 +313,18 @@ public:
       long getId() { return m_id; }
 
    private:
-      static long m_nextid;
+      static SAtomic<long> m_nextid;
 
       long m_id;
       SEventThread* m_thread;
       bool m_oneshot;
       long m_interval;
-      timer_t m_timer;
-      static void _timerHandler(int signo, siginfo_t *pinfo, void *pcontext);
    };
 
+   //
+   // timers used to be delivered with SIGRTMIN, the handler is no longer
+   // installed and this class is kept for source compatibility
+   //
    class TimerHandler
    {
    public:
@@ -159,6 +338,14 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   enum LoopMode
+   {
+      lmQueue,    // sleep on the message queue
+      lmEpoll     // sleep in epoll_wait(), the queue signals an eventfd
+   };
+
+   typedef std::function<void(int fd)> FdCallback;
+
    SEventThread( bool selfDestruct = false );
    virtual ~SEventThread();
 
@@ -166,36 +353,404 @@ public:
    // called after this object is constructed
    //
    void init( void *arg, bool suspended = false );
+   void init( void *arg, const SThreadOptions &options, bool suspended = false );
+
+   //
+   // selects the message queue implementation, capacity and overflow policy,
+   // must be called before init()
+   //
+   void initQueue( SQueue::QueueType type, size_t capacity = 0,
+                   SQueue::OverflowPolicy policy = SQueue::opBlock )
+   {
+      m_events.init( type, capacity, policy );
+   }
+
+   size_t getQueueSize() { return m_events.getSize(); }
+   size_t getQueueHighWaterMark() { return m_events.getHighWaterMark(); }
+   uint64_t getQueueDropped() { return m_events.getDropped(); }
+
+   //
+   // messages posted with postPriorityMessage() use a separate lane that is
+   // dispatched before the user backlog, with a non-zero limit one user
+   // message is dispatched after that many consecutive priority messages.
+   // The ETM_ control messages go ahead of both lanes.
+   //
+   void setStarvationLimit( size_t limit ) { m_events.setStarvationLimit( limit ); }
+   size_t getStarvationLimit() { return m_events.getStarvationLimit(); }
+
+   //
+   // per message id counts, queue wait and handler time histograms, off
+   // by default (see SDispatchStats).  getDispatchStats() can be called
+   // from any thread and adds the current and peak queue depth, the peak
+   // is the queue's high water mark and is cleared by resetDispatchStats().
+   //
+   void setDispatchStats( bool enabled ) { m_dstats.setEnabled( enabled ); }
+   bool isDispatchStatsEnabled() { return m_dstats.isEnabled(); }
+   void getDispatchStats( SDispatchStatsData &data );
+   void resetDispatchStats();
+
+   //
+   // lmEpoll lets the thread watch file descriptors as well as messages
+   // and timers without a second loop, must be called before init()
+   //
+   void setLoopMode( LoopMode mode ) { m_loopmode = mode; }
+   LoopMode getLoopMode() { return m_loopmode; }
+
+   //
+   // lmEpoll only.  onReadable is called when fd is readable or has an
+   // error or hangup pending, onWritable when it is writable, either may
+   // be empty.  Registering an fd again replaces its callbacks, from
+   // within one of them too, the new callbacks are used from the next
+   // poll on.  These must be called before init() or from this thread (a
+   // callback, dispatch(), onInit(), ...).  The fd is not closed by
+   // unregisterFd().
+   //
+   void registerFd( int fd, FdCallback onReadable, FdCallback onWritable = FdCallback() );
+   void unregisterFd( int fd );
+
+   //
+   // maximum number of messages removed from the queue per wakeup
+   //
+   void setDispatchBatchSize( size_t size ) { m_batchsize = size > 0 ? size : 1; }
+   size_t getDispatchBatchSize() { return m_batchsize; }
+
+   //
+   // onIdle() is called when no message has arrived for the idle timeout
+   // (milliseconds), zero disables it
+   //
+   void setIdleTimeout( long milliseconds ) { m_idletimeout = milliseconds; }
+   long getIdleTimeout() { return m_idletimeout; }
 
    //
    // these methods can be called from this thread or another
    //
-   void postMessage(uint16_t message);
-   void postMessage(SEventThreadMessage *msg);
+   // postMessage() returns false when the queue rejected the message, in
+   // which case the message has been deleted.  The ETM_ messages below
+   // ETM_USER go to the queue's control list, which user messages cannot
+   // reach and the capacity and overflow policy do not apply to, so they
+   // are never dropped.
+   //
+   // postPriorityMessage() queues the message on the priority lane so it is
+   // dispatched ahead of any messages posted with postMessage().
+   //
+   // Posting just a message id, or an id plus a trivially copyable payload
+   // of up to SQUEUE_INLINE_SIZE bytes with postInline(), copies it into
+   // the queue by value and allocates nothing.  dispatch() reads the
+   // payload with msg.as<T>().
+   //
+   bool postMessage(uint16_t message);
+   bool postMessage(SEventThreadMessage *msg);
+   bool postPriorityMessage(uint16_t message);
+   bool postPriorityMessage(SEventThreadMessage *msg);
+
+   template<class T>
+   bool postInline(uint16_t message, const T &payload)
+   {
+      SQueueEntry e;
+      e.set( message, payload );
+      return postEntry( e, false );
+   }
+
+   template<class T>
+   bool postPriorityInline(uint16_t message, const T &payload)
+   {
+      SQueueEntry e;
+      e.set( message, payload );
+      return postEntry( e, true );
+   }
+
+   //
+   // Scheduled posting.  The message is dispatched by the dispatch loop
+   // once the delay (milliseconds) has passed, or at the given wall clock
+   // time, ahead of the queued messages the way a timer fires.  The
+   // returned handle (never 0) cancels it, cancelScheduled() returns false
+   // once the message has been dispatched or cancelled.  Cancelled
+   // messages and those still pending when the thread is destroyed are
+   // deleted without being dispatched.
+   //
+   uint64_t postMessageAfter( long milliseconds, uint16_t message );
+   uint64_t postMessageAfter( long milliseconds, SEventThreadMessage *msg );
+   uint64_t postMessageAt( const STime &at, uint16_t message );
+   uint64_t postMessageAt( const STime &at, SEventThreadMessage *msg );
+
+   template<class T>
+   uint64_t postInlineAfter( long milliseconds, uint16_t message, const T &payload )
+   {
+      SQueueEntry e;
+      e.set( message, payload );
+      return schedule( milliseconds, e );
+   }
+
+   bool cancelScheduled( uint64_t handle );
+   size_t getScheduledCount();
+
+   //
+   // Runs fn() in this thread and returns a future for its result, see
+   // SEventThreadFuture.  Unlike the other ETM_ messages a call is queued
+   // behind the messages already posted, callPriority() queues it on the
+   // priority lane.
+   // Called from this thread fn() runs straight away.  If the queue
+   // rejects the call, the thread stops before getting to it or has
+   // already stopped, the future completes with an exception.  A call
+   // that races with the thread stopping completes at the latest when
+   // the SEventThread is destroyed.
+   //
+   template<class F>
+   SEventThreadFuture<typename std::result_of<F()>::type> call( F fn )
+   {
+      return callLane( std::move(fn), false );
+   }
+
+   template<class F>
+   SEventThreadFuture<typename std::result_of<F()>::type> callPriority( F fn )
+   {
+      return callLane( std::move(fn), true );
+   }
 
-   void quit();
+   //
+   // quit() stops the thread ahead of any queued messages, which are
+   // discarded.  quit( true ) lets the thread dispatch its backlog first
+   // and stop once the queue is empty, messages posted meanwhile are
+   // dispatched too.
+   //
+   void quit( bool drain = false );
    void suspend();
 
    void initTimer( SEventThread::Timer &t );
 
+   //
+   // Typed message handlers, kept in a table indexed by message id so the
+   // dispatch loop calls them without going through dispatch().  A handler
+   // takes either a message class posted with postMessage(), as
+   //
+   //    on<UpdateStatInterval>( &SStats::handleInterval );
+   //    void handleInterval( UpdateStatInterval &msg );
+   //
+   // where the id comes from UpdateStatInterval::MessageId unless it is
+   // given, or a payload posted by value with postInline(), as
+   //
+   //    on<StatResultData>( STAT_RSLT_MSG, &SStats::handleResult );
+   //    void handleResult( const StatResultData &data );
+   //
+   // A handler of the wrong class, a message class that does not derive
+   // from SEventThreadMessage and a payload that cannot be posted by value
+   // fail to compile.  A message posted the other way (by value for a
+   // message class handler other than SEventThreadMessage, on the heap or
+   // with a payload of another size for a payload handler) is passed to
+   // dispatch().  Handlers replace any
+   // previous handler for the id and must be registered before init() or
+   // from this thread.  The table grows to the highest id registered.
+   //
+   template<class T, class C>
+   void on( uint16_t id, void (C::*handler)( T &msg ) )
+   {
+      static_assert( std::is_base_of<SEventThread,C>::value, "the handler must be a member of an SEventThread" );
+      static_assert( std::is_base_of<SEventThreadMessage,T>::value,
+                     "a handler takes an SEventThreadMessage or a const reference to an inline payload" );
+
+      setHandler( id, new MessageHandler<C,T>( handler ) );
+   }
+
+   template<class T, class C>
+   void on( uint16_t id, void (C::*handler)( const T &msg ) )
+   {
+      static_assert( std::is_base_of<SEventThread,C>::value, "the handler must be a member of an SEventThread" );
+
+      setHandler( id, selectHandler<C,T>( handler, std::is_base_of<SEventThreadMessage,T>() ) );
+   }
+
+   template<class T, class C>
+   void on( void (C::*handler)( T &msg ) )
+   {
+      on<T>( T::MessageId, handler );
+   }
+
+   template<class T, class C>
+   void on( void (C::*handler)( const T &msg ) )
+   {
+      on<T>( T::MessageId, handler );
+   }
+
    //
    // these methods are executed by the SEventThread internals in the thread context
    //
-   virtual void dispatch( SEventThreadMessage &msg ) = 0;
+   // dispatch() gets the messages that have no handler registered with on()
+   //
+   virtual void dispatch( SEventThreadMessage &msg );
 
    virtual void onInit();
    virtual void onQuit();
    virtual void onSuspend();
    virtual void onTimer(SEventThread::Timer &ptimer);
 
+   //
+   // called before the first and after the last message of each batch
+   // removed from the queue, count is the number of messages in the batch
+   //
+   virtual void onBatchBegin(size_t count);
+   virtual void onBatchEnd(size_t count);
+
+   virtual void onIdle();
+
 protected:
 
 private:
+   //
+   // a handler registered with on(), which keeps the member function with
+   // its real type.  invoke() returns false for a message that was not
+   // posted the way the handler takes it.
+   //
+   class Handler
+   {
+   public:
+      virtual ~Handler() {}
+      virtual bool invoke( SEventThread *self, SEventThreadMessage &msg, bool byValue ) = 0;
+   };
+
+   template<class C, class T>
+   class MessageHandler : public Handler
+   {
+   public:
+      MessageHandler( void (C::*method)( T & ) ) : m_method( method ) {}
+
+      bool invoke( SEventThread *self, SEventThreadMessage &msg, bool byValue )
+      {
+         if ( byValue && !std::is_same<typename std::remove_const<T>::type,SEventThreadMessage>::value )
+            return false;
+
+         ( static_cast<C*>( self )->*m_method )( static_cast<T&>( msg ) );
+         return true;
+      }
+
+   private:
+      void (C::*m_method)( T & );
+   };
+
+   template<class C, class T>
+   class PayloadHandler : public Handler
+   {
+   public:
+      PayloadHandler( void (C::*method)( const T & ) ) : m_method( method ) {}
+
+      bool invoke( SEventThread *self, SEventThreadMessage &msg, bool byValue )
+      {
+         if ( !byValue || msg.getPayloadSize() != sizeof(T) )
+            return false;
+
+         ( static_cast<C*>( self )->*m_method )( msg.as<T>() );
+         return true;
+      }
+
+   private:
+      void (C::*m_method)( const T & );
+   };
+
+   template<class C, class T>
+   static Handler *selectHandler( void (C::*handler)( const T & ), std::true_type )
+   {
+      return new MessageHandler<C,const T>( handler );
+   }
+
+   template<class C, class T>
+   static Handler *selectHandler( void (C::*handler)( const T & ), std::false_type )
+   {
+      static_assert( std::is_trivially_copyable<T>::value, "inline payloads must be trivially copyable" );
+      static_assert( sizeof(T) <= SQUEUE_INLINE_SIZE, "inline payload too large" );
+
+      return new PayloadHandler<C,T>( handler );
+   }
+
+   // takes ownership of the handler
+   void setHandler( uint16_t id, Handler *handler );
+
+   template<class F>
+   SEventThreadFuture<typename std::result_of<F()>::type> callLane( F fn, bool priority )
+   {
+      typedef typename std::result_of<F()>::type R;
+
+      std::shared_ptr< SEventThreadCallState<R> > state = std::make_shared< SEventThreadCallState<R> >();
+      SEventThreadCall<F,R> *msg = new SEventThreadCall<F,R>( std::move(fn), state );
+
+      if ( isCurrentThread() )
+      {
+         msg->run();
+         delete msg;
+      }
+      else if ( m_stopped.load( std::memory_order_acquire ) )
+      {
+         // deleting the message completes the future with an error
+         delete msg;
+      }
+      else
+      {
+         // queued behind the user messages, postEntry() deletes it if rejected
+         SQueueEntry e;
+         e.set( msg );
+         postEntry( e, priority, false );
+      }
+
+      return SEventThreadFuture<R>( state );
+   }
+
+   bool isCurrentThread();
+
    unsigned long threadProc( void *arg );
    void dispatch();
+   bool dispatchMessage( SEventThreadMessage *msg, bool byValue );
+   //
+   // the ETM_ messages go to the control list unless control is false, as
+   // for ETM_CALL which keeps its place among the user messages
+   //
+   bool postEntry( const SQueueEntry &entry, bool priority, bool control = true );
+   bool pushEntry( const SQueueEntry &entry, bool priority, bool control );
+
+   struct FdWatch
+   {
+      int fd;
+      FdCallback onReadable;
+      FdCallback onWritable;
+   };
+
+   void initEpoll();
+   size_t pollEvents( SQueueEntry *entries, size_t max, uint64_t wakeAt, bool &active );
+   void checkLoopThread( const char *method );
+
+   struct ScheduledPost : public STimerWheelNode
+   {
+      uint64_t handle;
+      SQueueEntry entry;
+   };
+
+   void startTimer( Timer &t );
+   void stopTimer( Timer &t );
+   bool expireTimers( uint64_t now );
+   uint64_t schedule( long milliseconds, const SQueueEntry &entry );
+   bool expireScheduled( uint64_t now, bool &done );
+   static uint64_t getTick();
 
    static TimerHandler m_th;
    SQueue m_events;
+   SMutex m_timerMutex;
+   STimerWheel m_timers;
+   STimerWheel m_scheduled;
+   std::unordered_map<uint64_t,ScheduledPost*> m_posts;
+   uint64_t m_nexthandle;
+   Timer *m_firing;                    // the timer in onTimer(), see stopTimer()
+   int m_stopWaiters;
+   std::atomic<int> m_firedSeq;
+   std::atomic<bool> m_wakeup;
+   std::atomic<bool> m_drain;
+   std::atomic<bool> m_stopped;
+   size_t m_batchsize;
+   long m_idletimeout;
+   SDispatchStats m_dstats;
+   std::vector<Handler*> m_handlers;
+
+   LoopMode m_loopmode;
+   int m_epollfd;
+   int m_eventfd;
+   std::map<int,FdWatch*> m_fdwatches;
+   std::vector<FdWatch*> m_fdretired;
 };
 
 class STimerMessage : public SEventThreadMessage
@@ -0,0 +1,273 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __STHREADPOOL_H
+#define __STHREADPOOL_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ssync.h"
+#include "sthread.h"
+
+class SThreadPoolTask
+{
+public:
+   virtual ~SThreadPoolTask() {}
+   virtual void run() = 0;
+};
+
+template <class F>
+class SThreadPoolFunctionTask : public SThreadPoolTask
+{
+public:
+   SThreadPoolFunctionTask( F &&fn ) : m_fn( std::move(fn) ) {}
+   void run() { m_fn(); }
+
+private:
+   F m_fn;
+};
+
+//
+// A parallel_for()/parallel_reduce() range split into chunks.  Chunks are
+// handed out from a shared counter to the caller and to helper tasks
+// queued on the pool, the caller waits until every chunk has finished.
+// A helper that only starts after the last chunk was handed out returns
+// without touching the caller's functors, so it may outlive the call.
+//
+class SThreadPoolLoop
+{
+public:
+   SThreadPoolLoop( size_t chunks )
+      : m_next( 0 ), m_chunks( chunks ), m_remaining( chunks ), m_done( chunks == 0 ? 1 : 0 )
+   {
+   }
+   virtual ~SThreadPoolLoop() {}
+
+   // runs chunks until there are none left to hand out
+   void work();
+
+   bool isDone() { return m_done.load( std::memory_order_acquire ) != 0; }
+   std::atomic<int> &getDoneWord() { return m_done; }
+   size_t getChunks() { return m_chunks; }
+
+   // rethrows the first exception thrown by a chunk
+   void rethrow() { if ( m_error ) std::rethrow_exception( m_error ); }
+
+protected:
+   virtual void runChunk( size_t chunk ) = 0;
+
+private:
+   std::atomic<size_t> m_next;
+   size_t m_chunks;
+   std::atomic<size_t> m_remaining;
+   std::atomic<int> m_done;
+   SMutex m_errorMutex;
+   std::exception_ptr m_error;
+};
+
+template <class F>
+class SThreadPoolForLoop : public SThreadPoolLoop
+{
+public:
+   SThreadPoolForLoop( size_t begin, size_t end, size_t grain, F &body )
+      : SThreadPoolLoop( ( end - begin + grain - 1 ) / grain ),
+        m_begin( begin ), m_end( end ), m_grain( grain ), m_body( body )
+   {
+   }
+
+protected:
+   void runChunk( size_t chunk )
+   {
+      size_t b = m_begin + chunk * m_grain;
+      size_t e = b + m_grain < m_end ? b + m_grain : m_end;
+      for ( size_t i = b; i < e; i++ )
+         m_body( i );
+   }
+
+private:
+   size_t m_begin;
+   size_t m_end;
+   size_t m_grain;
+   F &m_body;
+};
+
+template <class T, class M>
+class SThreadPoolReduceLoop : public SThreadPoolLoop
+{
+public:
+   SThreadPoolReduceLoop( size_t begin, size_t end, size_t grain, const T &identity, M &map )
+      : SThreadPoolLoop( ( end - begin + grain - 1 ) / grain ),
+        m_begin( begin ), m_end( end ), m_grain( grain ), m_map( map ),
+        m_results( getChunks(), identity )
+   {
+   }
+
+   std::vector<T> &getResults() { return m_results; }
+
+protected:
+   void runChunk( size_t chunk )
+   {
+      size_t b = m_begin + chunk * m_grain;
+      size_t e = b + m_grain < m_end ? b + m_grain : m_end;
+      m_results[chunk] = m_map( b, e );
+   }
+
+private:
+   size_t m_begin;
+   size_t m_end;
+   size_t m_grain;
+   M &m_map;
+   std::vector<T> m_results;
+};
+
+class SThreadPoolWorker;
+
+//
+// Work-stealing executor for short CPU-bound tasks.
+//
+// Every worker owns a Chase-Lev deque.  A task submitted from a worker is
+// pushed on the bottom of that worker's deque and popped from the bottom
+// again (LIFO, so the data it touches is still in cache), a task submitted
+// from any other thread goes on a shared injection queue.  An idle worker
+// takes from its own deque, then the injection queue, then steals from the
+// top of the other workers' deques, and sleeps on a futex when everything
+// is empty.
+//
+// The workers finish every queued task before shutdown() returns.  An
+// exception thrown by a submit() task is delivered through its future, one
+// thrown by a post() task is discarded.  Blocking on a future from inside
+// a task can deadlock a small pool, use parallel_for()/parallel_reduce()
+// there instead, a worker waiting on those runs other tasks meanwhile.
+//
+class SThreadPool
+{
+   friend class SThreadPoolWorker;
+
+public:
+   SThreadPool();
+   ~SThreadPool();
+
+   //
+   // the options apply to the workers started by init(), except that
+   // worker i is named "<name>-<i>" and pinned to cpus[i % cpus.size()]
+   //
+   void setOptions( const SThreadOptions &options ) { m_options = options; }
+   const SThreadOptions &getOptions() { return m_options; }
+   void setName( const char *name ) { m_options.name = name; }
+   void setAffinity( const std::vector<int> &cpus ) { m_options.cpus = cpus; }
+
+   // starts the worker threads, 0 starts one per online CPU
+   void init( size_t workers = 0 );
+   void shutdown();
+
+   size_t getWorkerCount() { return m_workers.size(); }
+
+   // index of the calling thread in this pool, -1 if it is not a worker
+   int getWorkerIndex();
+
+   template <class F>
+   std::future<typename std::result_of<F()>::type> submit( F fn )
+   {
+      typedef typename std::result_of<F()>::type R;
+
+      std::packaged_task<R()> task( std::move(fn) );
+      std::future<R> result = task.get_future();
+      enqueue( new SThreadPoolFunctionTask< std::packaged_task<R()> >( std::move(task) ) );
+      return result;
+   }
+
+   template <class F>
+   void post( F fn )
+   {
+      enqueue( new SThreadPoolFunctionTask<F>( std::move(fn) ) );
+   }
+
+   //
+   // calls body(i) for every i in [begin,end), grain indexes per task (0
+   // picks a grain that gives each worker about four chunks).  The caller
+   // works on the range too and returns once every call has finished, the
+   // first exception thrown by body is rethrown.
+   //
+   template <class F>
+   void parallel_for( size_t begin, size_t end, F body, size_t grain = 0 )
+   {
+      if ( begin >= end )
+         return;
+
+      std::shared_ptr<SThreadPoolLoop> loop =
+         std::make_shared< SThreadPoolForLoop<F> >( begin, end, getGrain( end - begin, grain ), body );
+      runLoop( loop );
+   }
+
+   //
+   // splits [begin,end) into chunks, computes map(b,e) for every chunk
+   // [b,e) in parallel and folds the results in range order with
+   // reduce(T,T) starting from identity
+   //
+   template <class T, class M, class R>
+   T parallel_reduce( size_t begin, size_t end, T identity, M map, R reduce, size_t grain = 0 )
+   {
+      if ( begin >= end )
+         return identity;
+
+      std::shared_ptr< SThreadPoolReduceLoop<T,M> > loop =
+         std::make_shared< SThreadPoolReduceLoop<T,M> >( begin, end, getGrain( end - begin, grain ), identity, map );
+      runLoop( loop );
+
+      T result = identity;
+      for ( typename std::vector<T>::iterator it = loop->getResults().begin(); it != loop->getResults().end(); ++it )
+         result = reduce( result, *it );
+      return result;
+   }
+
+private:
+   SThreadPool( const SThreadPool & );
+   SThreadPool &operator=( const SThreadPool & );
+
+   void enqueue( SThreadPoolTask *task );
+   void notify();
+   void runLoop( std::shared_ptr<SThreadPoolLoop> loop );
+   size_t getGrain( size_t count, size_t grain );
+
+   SThreadPoolWorker *currentWorker();
+   SThreadPoolTask *findTask( SThreadPoolWorker *worker );
+   void runTask( SThreadPoolTask *task );
+   void workerLoop( SThreadPoolWorker &worker );
+
+   SThreadOptions m_options;
+   std::vector<SThreadPoolWorker*> m_workers;
+
+   SMutex m_injectMutex;
+   std::deque<SThreadPoolTask*> m_inject;
+   std::atomic<size_t> m_injected;
+
+   std::atomic<int> m_seq;
+   std::atomic<int> m_sleepers;
+   std::atomic<bool> m_stop;
+};
+
+#endif // #define __STHREADPOOL_H
@@ -0,0 +1,112 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __STIMERWHEEL_H
+#define __STIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class STimerWheel;
+
+//
+// An entry in an STimerWheel, embedded in (or a base class of) whatever
+// the timer stands for.  A node is in at most one wheel at a time.
+//
+class STimerWheelNode
+{
+   friend class STimerWheel;
+
+public:
+   STimerWheelNode() : m_prev( NULL ), m_next( NULL ), m_expiry( 0 ), m_slot( 0 ) {}
+
+   bool isActive() const { return m_next != NULL; }
+   uint64_t getExpiry() const { return m_expiry; }
+
+private:
+   STimerWheelNode( const STimerWheelNode & );
+   STimerWheelNode &operator=( const STimerWheelNode & );
+
+   STimerWheelNode *m_prev;
+   STimerWheelNode *m_next;
+   uint64_t m_expiry;
+   uint16_t m_slot;
+};
+
+//
+// Hierarchical timing wheel (Varghese and Lauck) with a resolution of one
+// tick.  SEventThread uses milliseconds of CLOCK_MONOTONIC as ticks.
+//
+// There are STIMERWHEEL_LEVELS levels of 64 slots, a timer is filed on the
+// level of the highest 6 bit digit in which its expiry differs from the
+// current tick and moves down a level each time the wheel reaches the start
+// of its slot.  start(), stop() and expiring a timer are O(1), empty slots
+// are skipped with a per-level occupancy mask.  Timers further out than
+// the top level can span are parked and refiled each time it wraps.
+//
+// The wheel is not thread safe.
+//
+const int STIMERWHEEL_BITS = 6;
+const int STIMERWHEEL_SLOTS = 1 << STIMERWHEEL_BITS;
+const int STIMERWHEEL_LEVELS = 6;
+
+class STimerWheel
+{
+public:
+   STimerWheel( uint64_t now = 0 );
+   ~STimerWheel();
+
+   // expiries at or before the current tick fire on the next expire()
+   void start( STimerWheelNode &node, uint64_t expiry );
+   void stop( STimerWheelNode &node );
+
+   //
+   // removes and returns one timer that has expired by now, NULL when there
+   // are none left.  The caller may start and stop timers, including the
+   // one returned, between calls.
+   //
+   STimerWheelNode *expire( uint64_t now );
+
+   //
+   // the tick by which expire() has to be called again, false if the wheel
+   // is empty.  This is the earliest expiry or, when the earliest timer is
+   // still on an upper level, the tick at which it moves down.
+   //
+   bool getNextTick( uint64_t &tick );
+
+   uint64_t getCurrentTick() { return m_current; }
+   size_t getCount() { return m_count; }
+
+   // detaches every timer without firing it
+   void clear();
+
+private:
+   STimerWheel( const STimerWheel & );
+   STimerWheel &operator=( const STimerWheel & );
+
+   void insert( STimerWheelNode &node );
+   void unlink( STimerWheelNode &node );
+   void cascade( int level );
+   int nextSlot( int level, int from );
+
+   uint64_t m_current;
+   size_t m_count;
+   uint64_t m_occupied[STIMERWHEEL_LEVELS];
+   STimerWheelNode m_slots[STIMERWHEEL_LEVELS * STIMERWHEEL_SLOTS];
+};
+
+#endif // #define __STIMERWHEEL_H
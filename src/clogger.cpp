@@ -14,6 +14,7 @@
 
 #include "clogger.h"
 #include "slogger.h"
+#include "ssync.h"
 
 //#define SPDLOG_LEVEL_NAMES { "trace", "debug", "info",  "warning", "error", "critical", "off" };
 #define SPDLOG_LEVEL_NAMES { "trace", "debug", "info",  "startup", "warn", "error", "off" };
@@ -32,8 +33,9 @@ public:
         static std::string serialize() { return singleton()._serialize(); }
         static bool updateLogger(const std::string &loggerName, int value) { return singleton()._updateLogger(loggerName, value); }
 
-        static SLogger &log(const int l) { return *singleton().m_loggers[l]; }
-	static int logCount() { return singleton().m_loggers.size(); }
+        static SLogger &log(const int l) { return *singleton()._find(l); }
+	static SLogger *find(const int l) { return singleton()._find(l); }
+	static int logCount() { return singleton()._logCount(); }
 
         static SLogger &stat() { return *singleton().m_stat; }
         static SLogger &audit() { return *singleton().m_audit; }
@@ -54,6 +56,8 @@ private:
         std::string _serialize();
         bool _updateLogger(const std::string &loggerName, int value);
 	int _addLogger(const char *logname);
+	SLogger *_find(int l);
+	int _logCount();
 
         std::vector<spdlog::sink_ptr> m_sinks;
         std::vector<spdlog::sink_ptr> m_statsinks;
@@ -62,6 +66,7 @@ private:
         std::string m_pattern;
 	int m_system;
 
+	SRWLock m_loggerslock;
 	std::vector<SLogger*> m_loggers;
         SLogger *m_stat;
         SLogger *m_audit;
@@ -203,7 +208,9 @@ int clUpdateLogger(const char *json, char **response)
 
 void clLog(const int logid, enum CLoggerSeverity sev, const char *fmt, ...)
 {
-	if (logid < 0 || logid >= Logger::logCount())
+	SLogger *logger = Logger::find(logid);
+
+	if (logger == NULL)
 		return;
 
         va_list args;
@@ -211,12 +218,12 @@ void clLog(const int logid, enum CLoggerSeverity sev, const char *fmt, ...)
 
 	switch (sev)
 	{
-		case eCLSeverityTrace:   { Logger::log(logid).trace_args( fmt, args );   break; }
-		case eCLSeverityDebug:   { Logger::log(logid).debug_args( fmt, args );   break; }
-		case eCLSeverityInfo:    { Logger::log(logid).info_args( fmt, args );    break; }
-		case eCLSeverityStartup: { Logger::log(logid).startup_args( fmt, args ); break; }
-		case eCLSeverityWarn:    { Logger::log(logid).warn_args( fmt, args );    break; }
-		case eCLSeverityError:   { Logger::log(logid).error_args( fmt, args );   break; }
+		case eCLSeverityTrace:   { logger->trace_args( fmt, args );   break; }
+		case eCLSeverityDebug:   { logger->debug_args( fmt, args );   break; }
+		case eCLSeverityInfo:    { logger->info_args( fmt, args );    break; }
+		case eCLSeverityStartup: { logger->startup_args( fmt, args ); break; }
+		case eCLSeverityWarn:    { logger->warn_args( fmt, args );    break; }
+		case eCLSeverityError:   { logger->error_args( fmt, args );   break; }
 	}
 
         va_end (args);
@@ -265,19 +272,35 @@ void Logger::_init( const char *app )
         m_stat = new SLogger( "stat", m_statsinks, "%v", optLogQueueSize );
         m_audit = new SLogger( "audit", m_auditsinks, "%v", optLogQueueSize );
 
-        m_loggers[clSystemLog]->set_level( spdlog::level::info );
+        _find(clSystemLog)->set_level( spdlog::level::info );
         m_stat->set_level(spdlog::level::info);
         m_audit->set_level(spdlog::level::trace);
 }
 
 int Logger::_addLogger(const char *logname)
 {
-	m_loggers.push_back(new SLogger(logname, m_sinks, m_pattern.c_str(), optLogQueueSize));
+	SLogger *logger = new SLogger(logname, m_sinks, m_pattern.c_str(), optLogQueueSize);
+	SWriteLock l(m_loggerslock);
+	m_loggers.push_back(logger);
 	return m_loggers.size() - 1;
 }
 
+SLogger *Logger::_find(int l)
+{
+	SReadLock lck(m_loggerslock);
+	return (l < 0 || l >= (int)m_loggers.size()) ? NULL : m_loggers[l];
+}
+
+int Logger::_logCount()
+{
+	SReadLock l(m_loggerslock);
+	return m_loggers.size();
+}
+
 void Logger::_cleanup()
 {
+	SWriteLock lck(m_loggerslock);
+
 	while (!m_loggers.empty())
 	{
 		SLogger *l = m_loggers.back();
@@ -292,6 +315,8 @@ void Logger::_cleanup()
 
 void Logger::_flush()
 {
+	SReadLock l(m_loggerslock);
+
 	for (auto it = m_loggers.begin(); it != m_loggers.end(); ++it) 
 		(*it)->flush();
         if ( m_stat )
@@ -308,6 +333,8 @@ std::string Logger::_serialize()
 
         RAPIDJSON_NAMESPACE::Value array(RAPIDJSON_NAMESPACE::kArrayType);
 
+	SReadLock lck(m_loggerslock);
+
 	for (auto it = m_loggers.begin(); it != m_loggers.end(); ++it)
 	{
 		RAPIDJSON_NAMESPACE::Value l(RAPIDJSON_NAMESPACE::kObjectType);
@@ -327,6 +354,8 @@ std::string Logger::_serialize()
 
 bool Logger::_updateLogger(const std::string &loggerName, int value)
 {
+	SReadLock l(m_loggerslock);
+
 	for (auto it = m_loggers.begin(); it != m_loggers.end(); ++it)
 	{
 		if ((*it)->get_name() == loggerName)
@@ -9,6 +9,7 @@
 
 #include "slogger.h"
 #include "stime.h"
+#include "ssync.h"
 
 #include "clogger.h"
 #include "cstats.h"
@@ -102,6 +103,7 @@ private:
 	static RestHandler *m_singleton;
 
 	SLogger *m_audit;
+	SRWLock m_routeslock;
 	std::map<std::string,_RestStaticHandler*> m_staticroutes;
 	std::map<std::string,_RestDynamicHandler*> m_dynamicroutes;
 };
@@ -199,6 +201,8 @@ void RestHandler::_registerStaticHandler(enum CRCommand cmd, const char *route,
 
 	srchstr += route;
 
+	SWriteLock l(m_routeslock);
+
 	auto srch = m_staticroutes.find(srchstr);
 
 	if (srch == m_staticroutes.end())
@@ -227,6 +231,8 @@ void RestHandler::_registerDynamicHandler(enum CRCommand cmd, const char *basero
 
 	srchstr += baseroute;
 
+	SWriteLock l(m_routeslock);
+
 	auto srch = m_dynamicroutes.find(srchstr);
 
 	if (srch == m_dynamicroutes.end())
@@ -259,9 +265,16 @@ void RestHandler::staticHandler(const Pistache::Rest::Request &request, Pistache
 
 	srchstr += request.resource();
 
-	auto srch = m_staticroutes.find(srchstr);
+	CRestStaticHandler handler = NULL;
 
-	if (srch == m_staticroutes.end())
+	{
+		SReadLock l(m_routeslock);
+		auto srch = m_staticroutes.find(srchstr);
+		if (srch != m_staticroutes.end())
+			handler = srch->second->getHandler();
+	}
+
+	if (handler == NULL)
 	{
 		std::stringstream ss;
 		ss << "{\"result\": \"Unrecognized resource [" << request.resource() << "]\"}";
@@ -270,7 +283,7 @@ void RestHandler::staticHandler(const Pistache::Rest::Request &request, Pistache
 	}
 
 	char *responseBody = NULL;
-	int code = (*srch->second->getHandler())(request.body().c_str(), &responseBody);
+	int code = (*handler)(request.body().c_str(), &responseBody);
 
 	if (responseBody)
 	{
@@ -288,27 +301,39 @@ void RestHandler::dynamicHandler(const Pistache::Rest::Request &request, Pistach
 	_auditLog(request);
 
 	std::string resource(request.resource());
+	std::string paramname;
+	CRestDynamicHandler handler = NULL;
 
-	for (auto it = m_dynamicroutes.begin(); it != m_dynamicroutes.end(); ++it)
 	{
-		if (resource.compare(0,it->first.size(),it->first) == 0)
+		SReadLock l(m_routeslock);
+		for (auto it = m_dynamicroutes.begin(); it != m_dynamicroutes.end(); ++it)
 		{
-			std::string param(request.param(it->second->getParam().c_str()).as<std::string>());
-			char *responseBody = NULL;
-			int code = (*it->second->getHandler())(param.c_str(), request.body().c_str(), &responseBody);
-			if (responseBody)
+			if (resource.compare(0,it->first.size(),it->first) == 0)
 			{
-				response.send((Pistache::Http::Code)code, responseBody);
-				free(responseBody);
-			}
-			else
-			{
-				response.send((Pistache::Http::Code)code);
+				paramname = it->second->getParam();
+				handler = it->second->getHandler();
+				break;
 			}
-			return;
 		}
 	}
 
+	if (handler != NULL)
+	{
+		std::string param(request.param(paramname.c_str()).as<std::string>());
+		char *responseBody = NULL;
+		int code = (*handler)(param.c_str(), request.body().c_str(), &responseBody);
+		if (responseBody)
+		{
+			response.send((Pistache::Http::Code)code, responseBody);
+			free(responseBody);
+		}
+		else
+		{
+			response.send((Pistache::Http::Code)code);
+		}
+		return;
+	}
+
 	std::stringstream ss;
 	ss << "{\"result\": \"Unrecognized resource [" << request.resource() << "]\"}";
 	response.send(Pistache::Http::Code::Bad_Request, ss.str());
@@ -316,6 +341,8 @@ void RestHandler::dynamicHandler(const Pistache::Rest::Request &request, Pistach
 
 void RestHandler::_registerRoutes(RestEndpoint &ep)
 {
+	SReadLock l(m_routeslock);
+
 	for (auto sit = m_staticroutes.begin(); sit != m_staticroutes.end(); ++sit)
 	{
 		switch (sit->second->getCommand())
@@ -11,6 +11,7 @@
 #include "slogger.h"
 #include "stime.h"
 #include "cstats.h"
+#include "slockprofile.h"
 
 #define RAPIDJSON_NAMESPACE statsrapidjson
 #include "rapidjson/document.h"
@@ -153,6 +154,7 @@ private:
 	SLogger *m_logger;
 	CStatsGetter m_getstat;
 	int m_maxvalues;
+	SRWLock m_categorieslock;
 	std::vector<CStatCategory*> m_categories;
 	SEventThread::Timer m_timer;
 };
@@ -230,6 +232,19 @@ int csGetLive(char **response)
 	return 200;
 }
 
+void csSetLockProfiling(int enabled)
+{
+	SLockProfiler::setEnabled(enabled != 0);
+}
+
+int csGetLockProfile(char **response)
+{
+	std::string profile;
+	SLockProfiler::serializeJSON(profile);
+	*response = strdup(profile.c_str());
+	return 200;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -258,7 +273,7 @@ void CStats::onQuit()
 
 void CStats::onTimer(SEventThread::Timer &t)
 {
-	postMessage(new CStatsGenerateCSV());
+	postPriorityMessage(CSTAT_GENERATE_CSV);
 }
 
 void CStats::dispatch(SEventThreadMessage &msg)
@@ -268,7 +283,7 @@ void CStats::dispatch(SEventThreadMessage &msg)
 		case CSTAT_UPDATE_INTERVAL:
 		{
 			m_timer.stop();
-			m_interval = ((CStatsUpdateInterval&)msg).getInterval();
+			m_interval = msg.isInline() ? msg.as<long>() : ((CStatsUpdateInterval&)msg).getInterval();
 			m_timer.setInterval(m_interval);
 			m_timer.start();
 			break;
@@ -287,6 +302,7 @@ void CStats::dispatch(SEventThreadMessage &msg)
 
 int CStats::addCategory(const char *name)
 {
+	SWriteLock l(m_categorieslock);
 	CStatCategory *c = new CStatCategory(name, m_categories.size());
 	m_categories.push_back(c);
 	return c->getId();
@@ -294,7 +310,9 @@ int CStats::addCategory(const char *name)
 
 int CStats::addValue(int categoryid, const char *name)
 {
-	if (categoryid < 0 && categoryid >= m_categories.size())
+	SWriteLock l(m_categorieslock);
+
+	if (categoryid < 0 || (size_t)categoryid >= m_categories.size())
 		return -1;
 
 	return m_categories[categoryid]->addValue(name);
@@ -302,8 +320,7 @@ int CStats::addValue(int categoryid, const char *name)
 
 void CStats::updateInterval(long interval)
 {
-	CStatsUpdateInterval *e = new CStatsUpdateInterval(interval);
-	postMessage(e);
+	postPriorityInline(CSTAT_UPDATE_INTERVAL, interval);
 } 
 
 void CStats::getCurrentStats()
@@ -311,13 +328,22 @@ void CStats::getCurrentStats()
 	if (!m_getstat)
 		return;
 
-	for (auto cit = m_categories.begin(); cit != m_categories.end(); ++cit)
+	// the getter may add categories or values, so it is called without the
+	// lock, values are never deleted while the stats thread runs
+	std::vector< std::pair<int,CStatValue*> > values;
+
 	{
-		for (auto vit = (*cit)->getValues().begin(); vit != (*cit)->getValues().end(); ++vit)
+		SReadLock l(m_categorieslock);
+
+		for (auto cit = m_categories.begin(); cit != m_categories.end(); ++cit)
 		{
-			(*vit)->setValue( (*m_getstat)((*cit)->getId(), (*vit)->getId()) );
+			for (auto vit = (*cit)->getValues().begin(); vit != (*cit)->getValues().end(); ++vit)
+				values.push_back(std::make_pair((*cit)->getId(), *vit));
 		}
 	}
+
+	for (auto it = values.begin(); it != values.end(); ++it)
+		it->second->setValue( (*m_getstat)(it->first, it->second->getId()) );
 }
 
 void CStats::serializeJSON(std::string &json)
@@ -333,6 +359,8 @@ void CStats::serializeJSON(std::string &json)
 
 	statsrapidjson::Value arrayValues(statsrapidjson::kArrayType);
 
+	SReadLock l(m_categorieslock);
+
 	for (auto cit = m_categories.begin(); cit != m_categories.end(); ++cit)
 	{
 		(*cit)->serialize(arrayValues, allocator);
@@ -356,6 +384,8 @@ void CStats::serializeCSV()
 
         now.Format(nowstr, "%Y-%m-%dT%H:%M:%S.%0", false);
 
+	SReadLock l(m_categorieslock);
+
 	for (auto cit = m_categories.begin(); cit != m_categories.end(); ++cit)
 	{
 		ss.str("");
@@ -0,0 +1,149 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <time.h>
+
+#include "sdispatchstats.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void SDispatchStatsData::serializeJSON( std::string &json ) const
+{
+   // names come from the code, only quotes and backslashes are escaped
+   json = "{\"name\":\"";
+   for ( std::string::const_iterator c = name.begin(); c != name.end(); ++c )
+   {
+      if ( *c == '"' || *c == '\\' )
+         json += '\\';
+      json += *c;
+   }
+   json += "\",\"enabled\":";
+   json += enabled ? "true" : "false";
+   json += ",\"queue_depth\":" + std::to_string( queueDepth );
+   json += ",\"queue_peak\":" + std::to_string( queuePeak );
+   json += ",\"dropped\":" + std::to_string( dropped );
+   json += ",\"dispatched\":" + std::to_string( dispatched );
+   json += ",\"ids\":[";
+
+   for ( std::vector<SDispatchIdStats>::const_iterator it = ids.begin(); it != ids.end(); ++it )
+   {
+      if ( it != ids.begin() )
+         json += ",";
+
+      json += "{\"id\":" + std::to_string( it->id );
+      json += ",\"count\":" + std::to_string( it->count );
+      json += ",\"queue_wait_us\":";
+      it->queueWait.serializeJSON( json );
+      json += ",\"handler_ns\":";
+      it->handlerTime.serializeJSON( json );
+      json += "}";
+   }
+
+   json += "]}";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+SDispatchStats::SDispatchStats()
+   : m_enabled( false ),
+     m_mutex( SMutex::mtNormal ),
+     m_dispatched( 0 )
+{
+}
+
+SDispatchStats::~SDispatchStats()
+{
+   for ( std::map<uint16_t,SDispatchIdStats*>::iterator it = m_ids.begin(); it != m_ids.end(); ++it )
+      delete it->second;
+}
+
+void SDispatchStats::flush()
+{
+   if ( m_pending.empty() )
+      return;
+
+   {
+      SMutexLock l( m_mutex );
+      SDispatchIdStats *stats = NULL;
+
+      for ( std::vector<Sample>::iterator it = m_pending.begin(); it != m_pending.end(); ++it )
+      {
+         // a batch is usually a run of the same few ids
+         if ( !stats || stats->id != it->id )
+         {
+            SDispatchIdStats *&entry = m_ids[it->id];
+            if ( !entry )
+            {
+               entry = new SDispatchIdStats();
+               entry->id = it->id;
+               entry->count = 0;
+            }
+            stats = entry;
+         }
+
+         stats->count++;
+         if ( it->stamped )
+            stats->queueWait.add( it->waitus );
+         stats->handlerTime.add( it->handlerns );
+      }
+
+      m_dispatched += m_pending.size();
+   }
+
+   m_pending.clear();
+}
+
+void SDispatchStats::snapshot( SDispatchStatsData &data )
+{
+   data.enabled = isEnabled();
+   data.ids.clear();
+
+   SMutexLock l( m_mutex );
+
+   data.dispatched = m_dispatched;
+   data.ids.reserve( m_ids.size() );
+   for ( std::map<uint16_t,SDispatchIdStats*>::iterator it = m_ids.begin(); it != m_ids.end(); ++it )
+      data.ids.push_back( *it->second );
+}
+
+void SDispatchStats::reset()
+{
+   SMutexLock l( m_mutex );
+
+   for ( std::map<uint16_t,SDispatchIdStats*>::iterator it = m_ids.begin(); it != m_ids.end(); ++it )
+      delete it->second;
+   m_ids.clear();
+   m_dispatched = 0;
+}
+
+uint32_t SDispatchStats::stamp()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+
+   uint32_t us = (uint32_t)( (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+   return us != 0 ? us : 1;
+}
+
+uint64_t SDispatchStats::now()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
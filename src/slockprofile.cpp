@@ -0,0 +1,333 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <algorithm>
+
+#include "slockprofile.h"
+#include "ssync.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class SLockProfile
+{
+public:
+   SLockProfile( const char *name )
+      : m_mutex( SMutex::mtNormal )
+   {
+      m_data.name = name;
+      m_data.acquisitions = 0;
+      m_data.contended = 0;
+   }
+
+   // the mutex guarding the profile is unnamed so it is never profiled
+   SMutex m_mutex;
+   SLockProfileData m_data;
+};
+
+namespace
+{
+
+const size_t PROFILE_SLOTS = 16;      // power of 2
+const uint64_t PROFILE_FLUSH_NS = 1000000000;
+
+struct ProfileSlot
+{
+   ProfileSlot() : profile( NULL ), acquisitions( 0 ), contended( 0 ), pending( 0 ) {}
+
+   SLockProfile *profile;
+   uint64_t acquisitions;
+   uint64_t contended;
+   SHistogram wait;
+   SHistogram hold;
+   uint32_t pending;
+};
+
+struct ProfileCache
+{
+   ProfileCache() : samples( 0 ), lastflush( 0 ) {}
+
+   ProfileSlot slots[PROFILE_SLOTS];
+   uint32_t samples;
+   uint64_t lastflush;
+};
+
+class ProfileRegistry
+{
+public:
+   SLockProfile *get( const char *name )
+   {
+      SMutexLock l( m_mutex );
+
+      std::map<std::string,SLockProfile*>::iterator it = m_profiles.find( name );
+      if ( it != m_profiles.end() )
+         return it->second;
+
+      SLockProfile *p = new SLockProfile( name );
+      m_profiles[name] = p;
+      return p;
+   }
+
+   void list( std::vector<SLockProfile*> &profiles )
+   {
+      SMutexLock l( m_mutex );
+
+      for ( std::map<std::string,SLockProfile*>::iterator it = m_profiles.begin(); it != m_profiles.end(); ++it )
+         profiles.push_back( it->second );
+   }
+
+private:
+   SMutex m_mutex;
+   std::map<std::string,SLockProfile*> m_profiles;
+};
+
+ProfileRegistry &registry()
+{
+   // never destroyed, named mutexes keep pointers to their profiles
+   static ProfileRegistry *r = new ProfileRegistry();
+   return *r;
+}
+
+std::atomic<bool> profileEnabled( false );
+
+__thread ProfileCache *tlsProfile = NULL;
+__thread bool tlsExited = false;
+
+void flushSlot( ProfileSlot &s )
+{
+   if ( !s.profile || s.pending == 0 )
+      return;
+
+   {
+      SMutexLock l( s.profile->m_mutex );
+
+      s.profile->m_data.acquisitions += s.acquisitions;
+      s.profile->m_data.contended += s.contended;
+      s.profile->m_data.wait.merge( s.wait );
+      s.profile->m_data.hold.merge( s.hold );
+   }
+
+   s.acquisitions = 0;
+   s.contended = 0;
+   s.wait.reset();
+   s.hold.reset();
+   s.pending = 0;
+}
+
+void flushCache( ProfileCache *c )
+{
+   for ( size_t i = 0; i < PROFILE_SLOTS; i++ )
+      flushSlot( c->slots[i] );
+}
+
+struct ProfileCacheGuard
+{
+   ~ProfileCacheGuard()
+   {
+      if ( tlsProfile )
+      {
+         flushCache( tlsProfile );
+         delete tlsProfile;
+         tlsProfile = NULL;
+      }
+      tlsExited = true;
+   }
+};
+
+thread_local ProfileCacheGuard tlsGuard;
+
+ProfileSlot *currentSlot( SLockProfile *profile )
+{
+   if ( !tlsProfile )
+   {
+      if ( tlsExited )
+         return NULL;
+      tlsProfile = new ProfileCache();
+      // touching the guard registers its destructor for this thread
+      (void)&tlsGuard;
+   }
+
+   ProfileSlot &s = tlsProfile->slots[ ( reinterpret_cast<uintptr_t>( profile ) >> 4 ) & ( PROFILE_SLOTS - 1 ) ];
+
+   if ( s.profile != profile )
+   {
+      flushSlot( s );
+      s.profile = profile;
+   }
+
+   return &s;
+}
+
+void sampled( ProfileSlot &s )
+{
+   if ( ++s.pending >= SLOCKPROFILE_FLUSH_COUNT )
+   {
+      flushSlot( s );
+      return;
+   }
+
+   // reading the clock on every sample would double the overhead
+   if ( ( ++tlsProfile->samples & 15 ) != 0 )
+      return;
+
+   uint64_t now = SLockProfiler::now();
+   if ( now - tlsProfile->lastflush >= PROFILE_FLUSH_NS )
+   {
+      tlsProfile->lastflush = now;
+      flushCache( tlsProfile );
+   }
+}
+
+bool byContended( const SLockProfileData &a, const SLockProfileData &b )
+{
+   return a.contended > b.contended;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void SLockProfiler::setEnabled( bool enabled )
+{
+   profileEnabled.store( enabled, std::memory_order_relaxed );
+}
+
+bool SLockProfiler::isEnabled()
+{
+   return profileEnabled.load( std::memory_order_relaxed );
+}
+
+SLockProfile *SLockProfiler::getProfile( const char *name )
+{
+   return name ? registry().get( name ) : NULL;
+}
+
+void SLockProfiler::recordAcquire( SLockProfile *profile, bool contended, uint64_t waitns )
+{
+   ProfileSlot *s = currentSlot( profile );
+   if ( !s )
+      return;
+
+   s->acquisitions++;
+   if ( contended )
+      s->contended++;
+   s->wait.add( waitns );
+
+   sampled( *s );
+}
+
+void SLockProfiler::recordHold( SLockProfile *profile, uint64_t holdns )
+{
+   ProfileSlot *s = currentSlot( profile );
+   if ( !s )
+      return;
+
+   s->hold.add( holdns );
+
+   sampled( *s );
+}
+
+void SLockProfiler::flush()
+{
+   if ( tlsProfile )
+      flushCache( tlsProfile );
+}
+
+void SLockProfiler::snapshot( std::vector<SLockProfileData> &profiles )
+{
+   std::vector<SLockProfile*> list;
+
+   flush();
+   registry().list( list );
+
+   for ( std::vector<SLockProfile*>::iterator it = list.begin(); it != list.end(); ++it )
+   {
+      SMutexLock l( (*it)->m_mutex );
+      profiles.push_back( (*it)->m_data );
+   }
+}
+
+void SLockProfiler::reset()
+{
+   std::vector<SLockProfile*> list;
+
+   // samples still held by other threads show up after the reset
+   if ( tlsProfile )
+   {
+      for ( size_t i = 0; i < PROFILE_SLOTS; i++ )
+         tlsProfile->slots[i] = ProfileSlot();
+   }
+
+   registry().list( list );
+
+   for ( std::vector<SLockProfile*>::iterator it = list.begin(); it != list.end(); ++it )
+   {
+      SMutexLock l( (*it)->m_mutex );
+      (*it)->m_data.acquisitions = 0;
+      (*it)->m_data.contended = 0;
+      (*it)->m_data.wait.reset();
+      (*it)->m_data.hold.reset();
+   }
+}
+
+void SLockProfiler::serializeJSON( std::string &json )
+{
+   std::vector<SLockProfileData> profiles;
+
+   snapshot( profiles );
+   std::sort( profiles.begin(), profiles.end(), byContended );
+
+   json = "{\"enabled\":";
+   json += isEnabled() ? "true" : "false";
+   json += ",\"locks\":[";
+
+   for ( std::vector<SLockProfileData>::iterator it = profiles.begin(); it != profiles.end(); ++it )
+   {
+      if ( it != profiles.begin() )
+         json += ",";
+
+      // names come from the code, only quotes and backslashes are escaped
+      json += "{\"name\":\"";
+      for ( std::string::iterator c = it->name.begin(); c != it->name.end(); ++c )
+      {
+         if ( *c == '"' || *c == '\\' )
+            json += '\\';
+         json += *c;
+      }
+      json += "\",\"acquisitions\":" + std::to_string( it->acquisitions );
+      json += ",\"contended\":" + std::to_string( it->contended );
+      json += ",\"wait_ns\":";
+      it->wait.serializeJSON( json );
+      json += ",\"hold_ns\":";
+      it->hold.serializeJSON( json );
+      json += "}";
+   }
+
+   json += "]}";
+}
+
+uint64_t SLockProfiler::now()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,245 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <new>
+#include <atomic>
+#include <vector>
+
+#include "spool.h"
+#include "ssync.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+const size_t POOL_CLASSES = 5;
+const size_t POOL_CLASS_SIZE[POOL_CLASSES] = { 32, 64, 128, 256, 512 };
+const size_t POOL_BLOCKS_PER_SLAB = 64;
+const unsigned int POOL_NO_CLASS = ~0u;
+
+struct PoolCache;
+
+// precedes every block handed out, 16 bytes to keep the payload aligned
+struct PoolHeader
+{
+   PoolCache *owner;
+   unsigned int sizeclass;
+   unsigned int reserved;
+};
+
+struct PoolBlock
+{
+   PoolHeader hdr;
+   PoolBlock *next;
+};
+
+struct PoolCache
+{
+   PoolCache()
+   {
+      for ( size_t i = 0; i < POOL_CLASSES; i++ )
+      {
+         local[i] = NULL;
+         remote[i].store( NULL, std::memory_order_relaxed );
+      }
+   }
+
+   PoolBlock *local[POOL_CLASSES];                 // owner thread only
+   std::atomic<PoolBlock*> remote[POOL_CLASSES];   // pushed by other threads
+};
+
+class PoolRegistry
+{
+public:
+   PoolCache *attach()
+   {
+      SMutexLock l( m_mutex );
+
+      if ( !m_orphans.empty() )
+      {
+         PoolCache *c = m_orphans.back();
+         m_orphans.pop_back();
+         return c;
+      }
+
+      return new PoolCache();
+   }
+
+   void detach( PoolCache *c )
+   {
+      SMutexLock l( m_mutex );
+      m_orphans.push_back( c );
+   }
+
+private:
+   SMutex m_mutex;
+   std::vector<PoolCache*> m_orphans;
+};
+
+PoolRegistry &registry()
+{
+   // never destroyed, caches may be referenced by blocks freed during exit
+   static PoolRegistry *r = new PoolRegistry();
+   return *r;
+}
+
+std::atomic<bool> poolEnabled( true );
+
+// the raw pointer stays valid after the guard below has been destroyed
+__thread PoolCache *tlsCache = NULL;
+__thread bool tlsExited = false;
+
+struct PoolCacheGuard
+{
+   ~PoolCacheGuard()
+   {
+      if ( tlsCache )
+      {
+         registry().detach( tlsCache );
+         tlsCache = NULL;
+      }
+      tlsExited = true;
+   }
+};
+
+thread_local PoolCacheGuard tlsGuard;
+
+PoolCache *currentCache()
+{
+   if ( !tlsCache && !tlsExited )
+   {
+      tlsCache = registry().attach();
+      // touching the guard registers its destructor for this thread
+      (void)&tlsGuard;
+   }
+
+   return tlsCache;
+}
+
+unsigned int sizeClass( size_t size )
+{
+   for ( unsigned int i = 0; i < POOL_CLASSES; i++ )
+   {
+      if ( size <= POOL_CLASS_SIZE[i] )
+         return i;
+   }
+
+   return POOL_NO_CLASS;
+}
+
+PoolBlock *refill( PoolCache *c, unsigned int cls )
+{
+   // take everything other threads have returned before carving a new slab
+   PoolBlock *b = c->remote[cls].exchange( NULL, std::memory_order_acquire );
+   if ( b )
+      return b;
+
+   size_t blocksize = sizeof(PoolHeader) + POOL_CLASS_SIZE[cls];
+   char *slab = static_cast<char*>( ::operator new( blocksize * POOL_BLOCKS_PER_SLAB ) );
+
+   for ( size_t i = 0; i < POOL_BLOCKS_PER_SLAB; i++ )
+   {
+      PoolBlock *blk = reinterpret_cast<PoolBlock*>( slab + i * blocksize );
+      blk->hdr.owner = c;
+      blk->hdr.sizeclass = cls;
+      blk->next = b;
+      b = blk;
+   }
+
+   return b;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void *SMessagePool::allocate( size_t size )
+{
+   unsigned int cls = sizeClass( size );
+   PoolCache *c = NULL;
+
+   if ( cls != POOL_NO_CLASS && poolEnabled.load( std::memory_order_relaxed ) )
+      c = currentCache();
+
+   if ( !c )
+   {
+      PoolHeader *hdr = static_cast<PoolHeader*>( ::operator new( sizeof(PoolHeader) + size ) );
+      hdr->owner = NULL;
+      hdr->sizeclass = POOL_NO_CLASS;
+      return hdr + 1;
+   }
+
+   PoolBlock *b = c->local[cls];
+   if ( !b )
+      b = refill( c, cls );
+
+   c->local[cls] = b->next;
+
+   return &b->hdr + 1;
+}
+
+void SMessagePool::release( void *ptr )
+{
+   if ( !ptr )
+      return;
+
+   PoolHeader *hdr = static_cast<PoolHeader*>( ptr ) - 1;
+   PoolCache *owner = hdr->owner;
+
+   if ( !owner )
+   {
+      ::operator delete( hdr );
+      return;
+   }
+
+   PoolBlock *b = reinterpret_cast<PoolBlock*>( hdr );
+   unsigned int cls = hdr->sizeclass;
+
+   if ( owner == tlsCache )
+   {
+      b->next = owner->local[cls];
+      owner->local[cls] = b;
+      return;
+   }
+
+   // the owner only ever takes the whole stack, so a plain CAS push is ABA safe
+   PoolBlock *head = owner->remote[cls].load( std::memory_order_relaxed );
+   do
+   {
+      b->next = head;
+   }
+   while ( !owner->remote[cls].compare_exchange_weak( head, b,
+      std::memory_order_release, std::memory_order_relaxed ) );
+}
+
+void SMessagePool::setEnabled( bool enabled )
+{
+   poolEnabled.store( enabled, std::memory_order_relaxed );
+}
+
+bool SMessagePool::isEnabled()
+{
+   return poolEnabled.load( std::memory_order_relaxed );
+}
+
+size_t SMessagePool::getMaxPooledSize()
+{
+   return POOL_CLASS_SIZE[POOL_CLASSES - 1];
+}
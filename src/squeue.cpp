@@ -15,8 +15,11 @@
 */
 
 #include <climits>
+#include <stddef.h>
+#include <unistd.h>
 
 #include "squeue.h"
+#include "serror.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,68 +33,835 @@ SQueueMessage::~SQueueMessage()
 {
 }
 
+void SQueueMessage::payloadMismatch( size_t size )
+{
+   SError::throwRuntimeException( "SQueueMessage::as() - message %u has a %u byte payload, %u requested",
+      (unsigned int)m_id, (unsigned int)getPayloadSize(), (unsigned int)size );
+}
+
+static_assert( sizeof(SQueueEntry) == 64, "SQueueEntry should stay at 64 bytes" );
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+SQueueRing::SQueueRing( size_t capacity )
+{
+   // round the capacity up to a power of 2 so the index can be masked
+   size_t size = 2;
+   while ( size < capacity )
+      size <<= 1;
+
+   m_cells = new Cell[size];
+   m_mask = size - 1;
+
+   for ( size_t i = 0; i < size; i++ )
+   {
+      m_cells[i].seq.store( i, std::memory_order_relaxed );
+      m_cells[i].entry.msg = NULL;
+   }
+
+   m_head.store( 0, std::memory_order_relaxed );
+   m_tail.store( 0, std::memory_order_relaxed );
+}
+
+SQueueRing::~SQueueRing()
+{
+   delete [] m_cells;
+}
+
+bool SQueueRing::push( const SQueueEntry &entry )
+{
+   Cell *cell;
+   size_t pos = m_head.load( std::memory_order_relaxed );
+
+   while ( true )
+   {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load( std::memory_order_acquire );
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+      if ( dif == 0 )
+      {
+         if ( m_head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            break;
+      }
+      else if ( dif < 0 )
+      {
+         // full
+         return false;
+      }
+      else
+      {
+         pos = m_head.load( std::memory_order_relaxed );
+      }
+   }
+
+   // only the bytes of the payload in use are copied
+   memcpy( &cell->entry, &entry, offsetof( SQueueEntry, payload ) + entry.size );
+   cell->seq.store( pos + 1, std::memory_order_release );
+
+   return true;
+}
+
+bool SQueueRing::pop( SQueueEntry &entry )
+{
+   Cell *cell;
+   size_t pos = m_tail.load( std::memory_order_relaxed );
+
+   while ( true )
+   {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load( std::memory_order_acquire );
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      if ( dif == 0 )
+      {
+         if ( m_tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            break;
+      }
+      else if ( dif < 0 )
+      {
+         // empty (or the next producer has not finished writing its cell)
+         return false;
+      }
+      else
+      {
+         pos = m_tail.load( std::memory_order_relaxed );
+      }
+   }
+
+   memcpy( &entry, &cell->entry, offsetof( SQueueEntry, payload ) + cell->entry.size );
+   cell->seq.store( pos + m_mask + 1, std::memory_order_release );
+
+   return true;
+}
+
+size_t SQueueRing::getSize()
+{
+   size_t tail = m_tail.load( std::memory_order_relaxed );
+   size_t head = m_head.load( std::memory_order_relaxed );
+
+   return head > tail ? head - tail : 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 SQueue::SQueue()
+   : m_type( qtLocked ),
+     m_policy( opBlock ),
+     m_capacity( 0 ),
+     m_lanecount( 1 ),
+     m_starvationLimit( 0 ),
+     m_consecutive( 0 ),
+     m_mutex( SMutex::mtNormal, false, SMUTEX_DEFAULT_SPIN_COUNT ),
+     m_controlMutex( SMutex::mtNormal ),
+     m_controlCount( 0 ),
+     m_ringParked( 0 ),
+     m_notifyfd( -1 ),
+     m_notifyArmed( 0 ),
+     m_spaceSeq( 0 ),
+     m_spaceWaiters( 0 ),
+     m_highwater( 0 ),
+     m_dropped( 0 )
 {
    //m_sem.init( 0, SEM_VALUE_MAX );
    m_sem.init( 0, 0 );
+   allocateLanes();
+}
+
+SQueue::SQueue( QueueType type, size_t capacity, OverflowPolicy policy )
+   : m_type( qtLocked ),
+     m_policy( opBlock ),
+     m_capacity( 0 ),
+     m_lanecount( 1 ),
+     m_starvationLimit( 0 ),
+     m_consecutive( 0 ),
+     m_mutex( SMutex::mtNormal, false, SMUTEX_DEFAULT_SPIN_COUNT ),
+     m_controlMutex( SMutex::mtNormal ),
+     m_controlCount( 0 ),
+     m_ringParked( 0 ),
+     m_notifyfd( -1 ),
+     m_notifyArmed( 0 ),
+     m_spaceSeq( 0 ),
+     m_spaceWaiters( 0 ),
+     m_highwater( 0 ),
+     m_dropped( 0 )
+{
+   m_sem.init( 0, 0 );
+   init( type, capacity, policy );
 }
 
 SQueue::~SQueue()
 {
-   SQueueMessage *m;
+   SQueueEntry e;
+
+   while ( pop( e, SDeadline( 0 ) ) )
+      e.discard();
 
-   while ( ( m = pop( false ) ) )
-      delete m;
+   freeLanes();
 }
 
-bool SQueue::push( uint16_t msgid, bool wait )
+void SQueue::init( QueueType type, size_t capacity, OverflowPolicy policy )
+{
+   SMutexLock l( m_mutex );
+
+   if ( !isEmpty() )
+      SError::throwRuntimeException( "SQueue::init() - the queue is not empty" );
+
+   m_type = type;
+   m_policy = policy;
+   m_capacity = capacity;
+
+   allocateLanes();
+   resetHighWaterMark();
+}
+
+void SQueue::setLanes( size_t lanes )
 {
-   SQueueMessage *m = new SQueueMessage( msgid );
+   SMutexLock l( m_mutex );
+
+   if ( !isEmpty() )
+      SError::throwRuntimeException( "SQueue::setLanes() - the queue is not empty" );
 
-   bool result = push( m, wait );
+   if ( lanes > SQUEUE_MAX_LANES )
+      SError::throwRuntimeException( "SQueue::setLanes() - at most %u lanes are supported", (unsigned int)SQUEUE_MAX_LANES );
 
-   if ( !result )
-      delete m;
+   m_lanecount = lanes > 0 ? lanes : 1;
 
-   return result;
+   allocateLanes();
+}
+
+void SQueue::allocateLanes()
+{
+   freeLanes();
+
+   m_consecutive = 0;
+
+   if ( m_type == qtRing )
+   {
+      for ( size_t i = 0; i < m_lanecount; i++ )
+         m_rings.push_back( new SQueueRing( m_capacity > 0 ? m_capacity : SQUEUE_DEFAULT_RING_CAPACITY ) );
+      m_capacity = m_rings[0]->getCapacity();
+   }
+   else
+   {
+      m_queues.resize( m_lanecount );
+   }
+}
+
+void SQueue::freeLanes()
+{
+   for ( auto it = m_rings.begin(); it != m_rings.end(); ++it )
+      delete *it;
+
+   m_rings.clear();
+   m_queues.clear();
+}
+
+bool SQueue::isEmpty()
+{
+   // m_mutex must be held by the caller for qtLocked
+   if ( m_controlCount.load( std::memory_order_acquire ) > 0 )
+      return false;
+
+   for ( size_t i = 0; i < m_queues.size(); i++ )
+   {
+      if ( !m_queues[i].empty() )
+         return false;
+   }
+
+   for ( size_t i = 0; i < m_rings.size(); i++ )
+   {
+      if ( m_rings[i]->getSize() > 0 )
+         return false;
+   }
+
+   return true;
+}
+
+size_t SQueue::getLaneSize( size_t lane )
+{
+   // m_mutex must be held by the caller for qtLocked
+   return m_type == qtRing ? m_rings[lane]->getSize() : m_queues[lane].size();
+}
+
+size_t SQueue::getCapacity()
+{
+   return m_capacity;
+}
+
+size_t SQueue::getSize()
+{
+   size_t size = m_controlCount.load( std::memory_order_acquire );
+
+   if ( m_type == qtRing )
+   {
+      for ( size_t i = 0; i < m_lanecount; i++ )
+         size += m_rings[i]->getSize();
+      return size;
+   }
+
+   SMutexLock l( m_mutex );
+
+   for ( size_t i = 0; i < m_lanecount; i++ )
+      size += m_queues[i].size();
+
+   return size;
+}
+
+bool SQueue::push( uint16_t msgid, bool wait )
+{
+   SQueueEntry e;
+   e.set( msgid );
+   return pushLane( e, 0, wait );
 }
 
 bool SQueue::push( SQueueMessage *msg, bool wait )
 {
-   SMutexLock l( m_mutex, false );
+   return pushLane( msg, 0, wait );
+}
+
+bool SQueue::push( const SQueueEntry &entry, bool wait )
+{
+   return pushLane( entry, 0, wait );
+}
+
+bool SQueue::pushLane( SQueueMessage *msg, size_t lane, bool wait )
+{
+   SQueueEntry e;
+   e.set( msg );
+   return pushLane( e, lane, wait );
+}
+
+bool SQueue::pushLane( const SQueueEntry &entry, size_t lane, bool wait )
+{
+   if ( lane >= m_lanecount )
+      SError::throwRuntimeException( "SQueue::pushLane() - invalid lane %u", (unsigned int)lane );
+
+   if ( m_type == qtRing )
+   {
+      if ( !pushRing( entry, lane, wait ) )
+         return false;
+      wakeConsumer();
+      return true;
+   }
+
+   return pushLocked( entry, lane, wait );
+}
+
+bool SQueue::pushUrgent( SQueueMessage *msg )
+{
+   SQueueEntry e;
+   e.set( msg );
+   return pushUrgent( e );
+}
+
+bool SQueue::pushUrgent( const SQueueEntry &entry )
+{
+   {
+      SMutexLock l( m_controlMutex );
+      m_control.push( entry );
+      m_controlCount.fetch_add( 1, std::memory_order_release );
+   }
 
-   if ( l.acquire( wait ) )
+   if ( m_type == qtRing )
+   {
+      wakeConsumer();
+   }
+   else
    {
-      m_queue.push( msg );
+      // the semaphore counts control messages too, take() finds them first
       m_sem.increment();
+      notifyConsumer();
+   }
+
+   return true;
+}
+
+SQueueMessage *SQueue::pop( bool wait )
+{
+   return pop( wait ? SDeadline() : SDeadline( 0 ) );
+}
+
+SQueueMessage *SQueue::timedPop( long milliseconds )
+{
+   return pop( SDeadline( milliseconds ) );
+}
+
+SQueueMessage *SQueue::pop( const SDeadline &deadline )
+{
+   SQueueEntry e;
+
+   if ( !pop( e, deadline ) )
+      return NULL;
+
+   return e.msg ? e.msg : new SQueueInlineMessage( e );
+}
+
+bool SQueue::pop( SQueueEntry &entry, const SDeadline &deadline )
+{
+   bool found = false;
+   size_t lane = 0;
+
+   if ( m_type == qtRing )
+   {
+      found = popRing( entry, deadline, lane );
+   }
+   else if ( m_sem.decrement( deadline ) )
+   {
+      // the semaphore guarantees a message, the lock is only held briefly
+      SMutexLock l( m_mutex );
+      found = take( entry, lane );
+   }
+
+   if ( found )
+      releaseProducers( lane );
+   
+   return found;
+}
+
+size_t SQueue::pushBatch( SQueueMessage **msgs, size_t count, bool wait )
+{
+   SQueueEntry entries[16];
+   size_t pushed = 0;
+
+   while ( pushed < count )
+   {
+      size_t cnt = count - pushed < 16 ? count - pushed : 16;
+
+      for ( size_t i = 0; i < cnt; i++ )
+         entries[i].set( msgs[pushed + i] );
+
+      size_t res = pushBatch( entries, cnt, wait );
+
+      pushed += res;
+
+      if ( res < cnt )
+         break;
+   }
+
+   return pushed;
+}
+
+size_t SQueue::pushBatch( const SQueueEntry *entries, size_t count, bool wait )
+{
+   size_t pushed = 0;
+
+   if ( m_type == qtRing )
+   {
+      for ( ; pushed < count; pushed++ )
+      {
+         if ( !pushRing( entries[pushed], 0, wait ) )
+            break;
+      }
+
+      if ( pushed > 0 )
+         wakeConsumer();
+
+      return pushed;
+   }
+
+   while ( pushed < count )
+   {
+      int seq = m_spaceSeq.load( std::memory_order_acquire );
+      EnqueueResult res = erQueued;
+      size_t before = pushed;
+
+      {
+         SMutexLock l( m_mutex );
+
+         while ( pushed < count && ( res = enqueueLocked( entries[pushed], 0 ) ) == erQueued )
+            pushed++;
+
+         if ( res == erFull && wait )
+            m_spaceWaiters.fetch_add( 1, std::memory_order_relaxed );
+      }
+
+      // before waiting for space, the consumer has to be awake to make it
+      if ( pushed > before )
+         notifyConsumer();
+
+      if ( res != erFull || !wait )
+         break;
+
+      waitForSpace( seq );
+   }
+
+   return pushed;
+}
+
+size_t SQueue::popBatch( SQueueMessage **msgs, size_t max, bool wait )
+{
+   return popBatch( msgs, max, wait ? SDeadline() : SDeadline( 0 ) );
+}
+
+size_t SQueue::popBatch( SQueueMessage **msgs, size_t max, const SDeadline &deadline )
+{
+   SQueueEntry entries[16];
+
+   size_t cnt = popBatch( entries, max < 16 ? max : 16, deadline );
+
+   for ( size_t i = 0; i < cnt; i++ )
+      msgs[i] = entries[i].msg ? entries[i].msg : new SQueueInlineMessage( entries[i] );
+
+   return cnt;
+}
+
+size_t SQueue::popBatch( SQueueEntry *entries, size_t max, const SDeadline &deadline )
+{
+   size_t cnt = 0;
+   size_t lane = 0;
+   size_t lanemask = 0;
+
+   if ( max == 0 )
+      return 0;
+
+   if ( m_type == qtRing )
+   {
+      if ( !popRing( entries[cnt], deadline, lane ) )
+         return 0;
+
+      // the lane is chosen per message so a control message that arrives
+      // part way through a batch still goes ahead of the rest
+      for ( lanemask |= (size_t)1 << lane, cnt++; cnt < max; cnt++ )
+      {
+         if ( !take( entries[cnt], lane ) )
+            break;
+         lanemask |= (size_t)1 << lane;
+      }
+   }
+   else if ( m_sem.decrement( deadline ) )
+   {
+      SMutexLock l( m_mutex );
+
+      // the first message was claimed above, claim the rest one
+      // semaphore count at a time so other consumers are not starved
+      do
+      {
+         take( entries[cnt++], lane );
+         lanemask |= (size_t)1 << lane;
+      }
+      while ( cnt < max && m_sem.decrement( false ) );
+   }
+
+   for ( lane = 0; lanemask != 0; lane++, lanemask >>= 1 )
+   {
+      if ( lanemask & 1 )
+         releaseProducers( lane );
+   }
+
+   return cnt;
+}
+
+bool SQueue::take( SQueueEntry &entry, size_t &lane )
+{
+   // consumer side, m_mutex must be held by the caller for qtLocked
+   if ( takeControl( entry ) )
+   {
+      // reported as the top lane, which only decides the producers released
+      lane = m_lanecount - 1;
       return true;
    }
 
+   bool lowfirst = m_starvationLimit > 0 && m_consecutive >= m_starvationLimit;
+
+   for ( size_t i = 0; i < m_lanecount; i++ )
+   {
+      bool found = false;
+
+      lane = lowfirst ? i : m_lanecount - 1 - i;
+
+      if ( m_type == qtRing )
+      {
+         found = m_rings[lane]->pop( entry );
+      }
+      else if ( !m_queues[lane].empty() )
+      {
+         entry = m_queues[lane].front();
+         m_queues[lane].pop();
+         found = true;
+      }
+
+      if ( found )
+      {
+         if ( lane == 0 || lowfirst )
+            m_consecutive = 0;
+         else
+            m_consecutive++;
+
+         return true;
+      }
+   }
+
    return false;
 }
 
-SQueueMessage *SQueue::pop( bool wait )
+bool SQueue::takeControl( SQueueEntry &entry )
+{
+   if ( m_controlCount.load( std::memory_order_acquire ) == 0 )
+      return false;
+
+   SMutexLock l( m_controlMutex );
+
+   if ( m_control.empty() )
+      return false;
+
+   entry = m_control.front();
+   m_control.pop();
+   m_controlCount.fetch_sub( 1, std::memory_order_relaxed );
+
+   return true;
+}
+
+SQueue::EnqueueResult SQueue::enqueueLocked( const SQueueEntry &entry, size_t lane )
 {
-   SQueueMessage *msg = NULL;
+   // m_mutex must be held by the caller
+   std::queue<SQueueEntry> &q = m_queues[lane];
 
-   if ( m_sem.decrement( wait ) )
+   if ( m_capacity == 0 || q.size() < m_capacity )
    {
-      SMutexLock l( m_mutex, false );
+      q.push( entry );
+      m_sem.increment();
+      updateHighWaterMark();
+      return erQueued;
+   }
 
-      if ( l.acquire( wait ) )
+   switch ( m_policy )
+   {
+      case opFailFast:
+      {
+         return erRejected;
+      }
+      case opDropNewest:
       {
-         msg = m_queue.front();
-         m_queue.pop();
+         delete entry.msg;
+         m_dropped.fetch_add( 1, std::memory_order_relaxed );
+         return erQueued;
+      }
+      case opDropOldest:
+      {
+         // the semaphore already counts the message being replaced
+         q.front().discard();
+         q.pop();
+         q.push( entry );
+         m_dropped.fetch_add( 1, std::memory_order_relaxed );
+         return erQueued;
+      }
+      default:
+      {
+         return erFull;
+      }
+   }
+}
+
+bool SQueue::pushLocked( const SQueueEntry &entry, size_t lane, bool wait )
+{
+   while ( true )
+   {
+      int seq = m_spaceSeq.load( std::memory_order_acquire );
+
+      EnqueueResult res;
+
+      {
+         SMutexLock l( m_mutex );
+
+         res = enqueueLocked( entry, lane );
+
+         if ( res == erFull && wait )
+            m_spaceWaiters.fetch_add( 1, std::memory_order_relaxed );
+      }
+
+      if ( res == erQueued )
+      {
+         notifyConsumer();
+         return true;
+      }
+      if ( res == erRejected || !wait )
+         return false;
+
+      waitForSpace( seq );
+   }
+}
+
+bool SQueue::pushRing( const SQueueEntry &entry, size_t lane, bool wait )
+{
+   SQueueRing *ring = m_rings[lane];
+
+   while ( !ring->push( entry ) )
+   {
+      switch ( m_policy )
+      {
+         case opFailFast:
+         {
+            return false;
+         }
+         case opDropNewest:
+         {
+            delete entry.msg;
+            m_dropped.fetch_add( 1, std::memory_order_relaxed );
+            return true;
+         }
+         case opDropOldest:
+         {
+            // the ring allows more than one thread to pop, so the producer
+            // can discard the oldest message itself and try again
+            SQueueEntry oldest;
+            if ( ring->pop( oldest ) )
+            {
+               oldest.discard();
+               m_dropped.fetch_add( 1, std::memory_order_relaxed );
+            }
+            continue;
+         }
+         default:
+         {
+            break;
+         }
+      }
+
+      if ( !wait )
+         return false;
+
+      // the ring is full, make sure the consumer is running (a batch
+      // push only wakes it at the end) and sleep until it frees a cell
+      wakeConsumer();
+
+      int seq = m_spaceSeq.load( std::memory_order_acquire );
+      m_spaceWaiters.fetch_add( 1, std::memory_order_seq_cst );
+
+      if ( ring->push( entry ) )
+      {
+         m_spaceWaiters.fetch_sub( 1, std::memory_order_relaxed );
+         break;
+      }
+
+      waitForSpace( seq );
+   }
+
+   updateHighWaterMark();
+
+   return true;
+}
+
+bool SQueue::popRing( SQueueEntry &entry, const SDeadline &deadline, size_t &lane )
+{
+   while ( !take( entry, lane ) )
+   {
+      if ( !deadline.isInfinite() && deadline.isExpired() )
+         return false;
+
+      // announce that we are about to sleep and check once more so that
+      // a producer that missed the flag cannot leave a message behind
+      m_ringParked.store( 1, std::memory_order_seq_cst );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+
+      if ( take( entry, lane ) )
+      {
+         m_ringParked.store( 0, std::memory_order_relaxed );
+         break;
+      }
+
+      if ( deadline.isInfinite() )
+      {
+         SFutex::wait( m_ringParked, 1 );
+      }
+      else if ( !SFutex::waitUntil( m_ringParked, 1, deadline.getTimespec() ) )
+      {
+         // timed out, a producer that saw the flag only costs a spare wake
+         m_ringParked.store( 0, std::memory_order_relaxed );
+         return take( entry, lane );
+      }
+   }
+
+   return true;
+}
+
+void SQueue::waitForSpace( int seq )
+{
+   // m_spaceWaiters was incremented by the caller
+   SFutex::wait( m_spaceSeq, seq );
+   m_spaceWaiters.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+void SQueue::wakeConsumer()
+{
+   // wake the consumer only if it is parked
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   if ( m_ringParked.load( std::memory_order_relaxed ) == 1 &&
+        m_ringParked.exchange( 0 ) == 1 )
+      SFutex::wake( m_ringParked, 1 );
+
+   notifyConsumer();
+}
+
+void SQueue::notifyConsumer()
+{
+   if ( m_notifyfd < 0 )
+      return;
+
+   // pairs with the fence in armNotify()
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   if ( m_notifyArmed.load( std::memory_order_relaxed ) == 1 &&
+        m_notifyArmed.exchange( 0 ) == 1 )
+   {
+      uint64_t one = 1;
+      ssize_t rc = write( m_notifyfd, &one, sizeof(one) );
+      (void)rc;
+   }
+}
+
+bool SQueue::armNotify()
+{
+   m_notifyArmed.store( 1, std::memory_order_seq_cst );
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+
+   if ( getSize() > 0 )
+   {
+      m_notifyArmed.store( 0, std::memory_order_relaxed );
+      return false;
+   }
+
+   return true;
+}
+
+void SQueue::releaseProducers( size_t lane )
+{
+   // release the producers waiting for space once the lane is half empty,
+   // waking them one message at a time just trades places with them
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   if ( m_spaceWaiters.load( std::memory_order_relaxed ) > 0 )
+   {
+      size_t size;
+
+      if ( m_type == qtRing )
+      {
+         size = m_rings[lane]->getSize();
       }
       else
       {
-         // increment the message count since we could not lock the queue
-         m_sem.increment();
+         SMutexLock l( m_mutex );
+         size = m_queues[lane].size();
+      }
+
+      if ( size <= m_capacity / 2 )
+      {
+         m_spaceSeq.fetch_add( 1, std::memory_order_release );
+         SFutex::wake( m_spaceSeq, INT_MAX );
       }
    }
-   
-   return msg;
+}
+
+void SQueue::updateHighWaterMark()
+{
+   size_t size = 0;
+
+   // m_mutex must be held by the caller for qtLocked
+   for ( size_t i = 0; i < m_lanecount; i++ )
+      size += getLaneSize( i );
+
+   size_t hw = m_highwater.load( std::memory_order_relaxed );
+
+   while ( size > hw &&
+      !m_highwater.compare_exchange_weak( hw, size, std::memory_order_relaxed ) );
 }
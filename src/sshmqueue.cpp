@@ -0,0 +1,494 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+#include "sshmqueue.h"
+#include "serror.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+const uint32_t SHMQUEUE_MAGIC = 0x53484d51;     // "SHMQ"
+const uint32_t SHMQUEUE_VERSION = 1;
+const int32_t SHMQUEUE_READY = -1;
+const long SHMQUEUE_INIT_TIMEOUT = 5000;
+
+struct ShmSlot
+{
+   uint16_t msgid;
+   uint16_t reserved;
+   uint32_t len;
+};
+
+size_t slotStride( uint32_t slotSize )
+{
+   return ( sizeof(ShmSlot) + slotSize + 7 ) & ~(size_t)7;
+}
+
+bool waitSeq( std::atomic<int> &word, int seq, const SDeadline &deadline )
+{
+   if ( deadline.isInfinite() )
+   {
+      SFutex::wait( word, seq, true );
+      return true;
+   }
+
+   if ( deadline.isExpired() )
+      return false;
+
+   return SFutex::waitUntil( word, seq, deadline.getTimespec(), true );
+}
+
+}
+
+//
+// lives at the start of the segment, everything except the futex words
+// is only accessed with the mutex held
+//
+struct SShmQueueHeader
+{
+   // 0 until initialized, then SHMQUEUE_READY, see SShmQueue::init()
+   std::atomic<int32_t> state;
+
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slotcount;
+   uint32_t slotsize;
+   uint32_t slotstride;
+
+   pthread_mutex_t mutex;
+   uint64_t head;
+   uint64_t tail;
+   uint64_t recoveries;
+
+   alignas(64) std::atomic<int> dataseq;
+   std::atomic<int> datawaiters;
+   alignas(64) std::atomic<int> spaceseq;
+   std::atomic<int> spacewaiters;
+};
+
+namespace
+{
+
+size_t headerSize()
+{
+   return ( sizeof(SShmQueueHeader) + 63 ) & ~(size_t)63;
+}
+
+void setup( SShmQueueHeader *hdr, uint32_t slotCount, uint32_t slotSize )
+{
+   pthread_mutexattr_t attr;
+   int res;
+
+   hdr->magic = SHMQUEUE_MAGIC;
+   hdr->version = SHMQUEUE_VERSION;
+   hdr->slotcount = slotCount;
+   hdr->slotsize = slotSize;
+   hdr->slotstride = slotStride( slotSize );
+   hdr->head = 0;
+   hdr->tail = 0;
+   hdr->recoveries = 0;
+   hdr->dataseq.store( 0, std::memory_order_relaxed );
+   hdr->datawaiters.store( 0, std::memory_order_relaxed );
+   hdr->spaceseq.store( 0, std::memory_order_relaxed );
+   hdr->spacewaiters.store( 0, std::memory_order_relaxed );
+
+   if ( ( res = pthread_mutexattr_init( &attr ) ) != 0 )
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue::init() - Unable to initialize mutex", res );
+
+   res = pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+   if ( res == 0 )
+      res = pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+   if ( res == 0 )
+      res = pthread_mutex_init( &hdr->mutex, &attr );
+
+   pthread_mutexattr_destroy( &attr );
+
+   if ( res != 0 )
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue::init() - Unable to initialize mutex", res );
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+SShmQueue::SShmQueue()
+   : m_hdr( NULL ),
+     m_mapsize( 0 )
+{
+}
+
+SShmQueue::~SShmQueue()
+{
+   close();
+}
+
+void SShmQueue::init( const char *name, uint32_t slotCount, uint32_t slotSize )
+{
+   if ( slotCount == 0 || slotSize == 0 )
+      SError::throwRuntimeException( "SShmQueue::init() - the slot count and slot size must be greater than zero" );
+
+   close();
+
+   size_t size = headerSize() + (size_t)slotCount * slotStride( slotSize );
+   struct stat st;
+
+   int fd = shm_open( name, O_CREAT | O_RDWR, 0660 );
+   if ( fd == -1 )
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue::init() - Unable to open the shared memory segment" );
+
+   // a new segment is zero filled, which is the uninitialized state
+   if ( fstat( fd, &st ) == -1 || ( st.st_size == 0 && ftruncate( fd, size ) == -1 ) )
+   {
+      int err = errno;
+      ::close( fd );
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue::init() - Unable to size the shared memory segment", err );
+   }
+
+   if ( st.st_size != 0 && (size_t)st.st_size != size )
+   {
+      ::close( fd );
+      SError::throwRuntimeException( "SShmQueue::init() - %s exists with a different size", name );
+   }
+
+   //
+   // the segment is initialized with an exclusive file lock held on it.
+   // The kernel drops the lock when its holder dies, so a segment that is
+   // not ready once the lock is ours was left half initialized and is
+   // simply initialized again, whatever became of the pid that started.
+   //
+   SDeadline deadline( SHMQUEUE_INIT_TIMEOUT );
+
+   while ( flock( fd, LOCK_EX | LOCK_NB ) == -1 )
+   {
+      int err = errno;
+
+      if ( err != EWOULDBLOCK && err != EINTR )
+      {
+         ::close( fd );
+         SError::throwRuntimeExceptionWithErrno( "SShmQueue::init() - Unable to lock the shared memory segment", err );
+      }
+
+      if ( deadline.isExpired() )
+      {
+         ::close( fd );
+         SError::throwRuntimeException( "SShmQueue::init() - timeout waiting for %s to be initialized", name );
+      }
+
+      usleep( 1000 );
+   }
+
+   try
+   {
+      map( fd, size );
+      m_name = name;
+
+      if ( m_hdr->state.load( std::memory_order_acquire ) != SHMQUEUE_READY )
+      {
+         setup( m_hdr, slotCount, slotSize );
+         m_hdr->state.store( SHMQUEUE_READY, std::memory_order_release );
+      }
+   }
+   catch ( ... )
+   {
+      // closing the descriptor releases the lock
+      ::close( fd );
+      close();
+      throw;
+   }
+
+   ::close( fd );
+
+   if ( m_hdr->magic != SHMQUEUE_MAGIC || m_hdr->version != SHMQUEUE_VERSION ||
+        m_hdr->slotcount != slotCount || m_hdr->slotsize != slotSize )
+   {
+      close();
+      SError::throwRuntimeException( "SShmQueue::init() - %s exists with a different layout", name );
+   }
+}
+
+void SShmQueue::attach( const char *name, long milliseconds )
+{
+   close();
+
+   SDeadline deadline( milliseconds );
+   struct stat st;
+
+   int fd = shm_open( name, O_RDWR, 0660 );
+   if ( fd == -1 )
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue::attach() - Unable to open the shared memory segment" );
+
+   // the creator sizes the segment right after creating it
+   while ( true )
+   {
+      if ( fstat( fd, &st ) == -1 )
+      {
+         int err = errno;
+         ::close( fd );
+         SError::throwRuntimeExceptionWithErrno( "SShmQueue::attach() - Unable to stat the shared memory segment", err );
+      }
+
+      if ( (size_t)st.st_size >= headerSize() )
+         break;
+
+      if ( deadline.isExpired() )
+      {
+         ::close( fd );
+         SError::throwRuntimeException( "SShmQueue::attach() - timeout waiting for %s to be created", name );
+      }
+      usleep( 1000 );
+   }
+
+   try
+   {
+      map( fd, st.st_size );
+   }
+   catch ( ... )
+   {
+      ::close( fd );
+      throw;
+   }
+
+   ::close( fd );
+   m_name = name;
+
+   while ( m_hdr->state.load( std::memory_order_acquire ) != SHMQUEUE_READY )
+   {
+      if ( deadline.isExpired() )
+      {
+         close();
+         SError::throwRuntimeException( "SShmQueue::attach() - timeout waiting for %s to be initialized", name );
+      }
+      usleep( 1000 );
+   }
+
+   if ( m_hdr->magic != SHMQUEUE_MAGIC || m_hdr->version != SHMQUEUE_VERSION ||
+        headerSize() + (size_t)m_hdr->slotcount * m_hdr->slotstride > m_mapsize )
+   {
+      close();
+      SError::throwRuntimeException( "SShmQueue::attach() - %s is not a valid queue", name );
+   }
+}
+
+// the caller closes fd, the mapping does not need it
+void SShmQueue::map( int fd, size_t size )
+{
+   void *p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+   int err = errno;
+
+   if ( p == MAP_FAILED )
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue - Unable to map the shared memory segment", err );
+
+   m_hdr = static_cast<SShmQueueHeader*>( p );
+   m_mapsize = size;
+}
+
+void SShmQueue::close()
+{
+   if ( m_hdr )
+   {
+      munmap( m_hdr, m_mapsize );
+      m_hdr = NULL;
+      m_mapsize = 0;
+   }
+}
+
+void SShmQueue::unlink( const char *name )
+{
+   shm_unlink( name );
+}
+
+void SShmQueue::lock()
+{
+   if ( !m_hdr )
+      SError::throwRuntimeException( "SShmQueue - the queue is not open" );
+
+   int res = pthread_mutex_lock( &m_hdr->mutex );
+
+   if ( res == EOWNERDEAD )
+   {
+      // head and tail only move once a copy is complete, so the ring is
+      // consistent no matter where the previous owner died
+      pthread_mutex_consistent( &m_hdr->mutex );
+      m_hdr->recoveries++;
+   }
+   else if ( res != 0 )
+   {
+      SError::throwRuntimeExceptionWithErrno( "SShmQueue - Unable to lock the queue", res );
+   }
+}
+
+void SShmQueue::unlock()
+{
+   pthread_mutex_unlock( &m_hdr->mutex );
+}
+
+char *SShmQueue::getSlot( uint64_t pos )
+{
+   return reinterpret_cast<char*>( m_hdr ) + headerSize() + ( pos % m_hdr->slotcount ) * m_hdr->slotstride;
+}
+
+bool SShmQueue::push( uint16_t msgid, const void *data, size_t len, bool wait )
+{
+   return push( msgid, data, len, wait ? SDeadline() : SDeadline( 0 ) );
+}
+
+bool SShmQueue::push( uint16_t msgid, const void *data, size_t len, const SDeadline &deadline )
+{
+   if ( m_hdr && len > m_hdr->slotsize )
+      SError::throwRuntimeException( "SShmQueue::push() - message length %u exceeds the slot size %u",
+         (unsigned int)len, m_hdr->slotsize );
+
+   while ( true )
+   {
+      int seq;
+
+      lock();
+
+      seq = m_hdr->spaceseq.load( std::memory_order_acquire );
+
+      if ( m_hdr->tail - m_hdr->head < m_hdr->slotcount )
+      {
+         ShmSlot *slot = reinterpret_cast<ShmSlot*>( getSlot( m_hdr->tail ) );
+
+         slot->msgid = msgid;
+         slot->len = len;
+         if ( len > 0 )
+            memcpy( slot + 1, data, len );
+
+         m_hdr->tail++;
+
+         unlock();
+
+         m_hdr->dataseq.fetch_add( 1, std::memory_order_seq_cst );
+         if ( m_hdr->datawaiters.load( std::memory_order_seq_cst ) > 0 )
+            SFutex::wake( m_hdr->dataseq, 1, true );
+
+         return true;
+      }
+
+      // a waiter that dies leaves the count high, which only costs wakeups
+      m_hdr->spacewaiters.fetch_add( 1, std::memory_order_seq_cst );
+
+      unlock();
+
+      bool signaled = waitSeq( m_hdr->spaceseq, seq, deadline );
+
+      m_hdr->spacewaiters.fetch_sub( 1, std::memory_order_relaxed );
+
+      if ( !signaled )
+         return false;
+   }
+}
+
+bool SShmQueue::pop( uint16_t &msgid, void *data, size_t &len, bool wait )
+{
+   return pop( msgid, data, len, wait ? SDeadline() : SDeadline( 0 ) );
+}
+
+bool SShmQueue::pop( uint16_t &msgid, void *data, size_t &len, const SDeadline &deadline )
+{
+   while ( true )
+   {
+      int seq;
+
+      lock();
+
+      seq = m_hdr->dataseq.load( std::memory_order_acquire );
+
+      if ( m_hdr->tail != m_hdr->head )
+      {
+         ShmSlot *slot = reinterpret_cast<ShmSlot*>( getSlot( m_hdr->head ) );
+
+         if ( slot->len > len )
+         {
+            size_t needed = slot->len;
+            unlock();
+            SError::throwRuntimeException( "SShmQueue::pop() - the buffer (%u) is smaller than the message (%u)",
+               (unsigned int)len, (unsigned int)needed );
+         }
+
+         msgid = slot->msgid;
+         len = slot->len;
+         if ( len > 0 )
+            memcpy( data, slot + 1, len );
+
+         m_hdr->head++;
+
+         unlock();
+
+         m_hdr->spaceseq.fetch_add( 1, std::memory_order_seq_cst );
+         if ( m_hdr->spacewaiters.load( std::memory_order_seq_cst ) > 0 )
+            SFutex::wake( m_hdr->spaceseq, INT_MAX, true );
+
+         return true;
+      }
+
+      m_hdr->datawaiters.fetch_add( 1, std::memory_order_seq_cst );
+
+      unlock();
+
+      bool signaled = waitSeq( m_hdr->dataseq, seq, deadline );
+
+      m_hdr->datawaiters.fetch_sub( 1, std::memory_order_relaxed );
+
+      if ( !signaled )
+         return false;
+   }
+}
+
+uint32_t SShmQueue::getCapacity()
+{
+   return m_hdr ? m_hdr->slotcount : 0;
+}
+
+uint32_t SShmQueue::getSlotSize()
+{
+   return m_hdr ? m_hdr->slotsize : 0;
+}
+
+size_t SShmQueue::getSize()
+{
+   lock();
+   size_t size = m_hdr->tail - m_hdr->head;
+   unlock();
+
+   return size;
+}
+
+uint64_t SShmQueue::getRecoveries()
+{
+   lock();
+   uint64_t recoveries = m_hdr->recoveries;
+   unlock();
+
+   return recoveries;
+}
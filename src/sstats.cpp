@@ -19,6 +19,7 @@
 
 #include <ctime>
 #include <memory>
+#include <algorithm>
 
 
 
@@ -121,6 +122,11 @@ SStats::SStats(bool logElapsed, StatSerializationMode serializ_mode, StatSeriali
       default:
          break;
    }
+
+   on<SEventThreadMessage>( STAT_CONSOLIDATE_EVENT, &SStats::handleConsolidate );
+   on<UpdateStatInterval>( &SStats::handleInterval );
+   on<StatResultData>( STAT_RSLT_MSG, &SStats::handleResult );
+   on<StatAttempData>( STAT_ATTEMPT_MSG, &SStats::handleAttemp );
 }
 
 SStats::~SStats(){
@@ -158,52 +164,78 @@ void SStats::onQuit(){
 void SStats::onTimer( SEventThread::Timer &t )
 {
    if ( t.getId() == m_idletimer.getId() ){
-      postMessage( STAT_CONSOLIDATE_EVENT );
+      postPriorityMessage( STAT_CONSOLIDATE_EVENT );
    }
 }
 
 void SStats::updateInterval (long interval){
-   UpdateStatInterval *e = new UpdateStatInterval( interval );
-   postMessage( e );
+   postPriorityMessage( new UpdateStatInterval(interval) );
 }
 
 std::shared_ptr<std::string> SStats::getLive(){
    auto stats = std::make_shared<std::string>();
-   auto event = std::make_shared<SEvent>();
-   StatLive *e = new StatLive(event, stats);
-   postMessage( e );
-   event->wait( 5000 );
+   auto live = callPriority( [this]() {
+      StatLive msg( std::make_shared<std::string>() );
+      dispatchDerived( msg );
+      return *msg.getlivestats();
+   } );
+
+   // on timeout the call still runs later, it only writes into its own copy
+   if ( live.wait( 5000 ) ){
+      try {
+         *stats = live.get();
+      }
+      catch(const std::exception &) {
+         // the thread is not running or the handler threw, no live stats
+         // just as on a timeout
+      }
+   }
    return stats;
 }
 
 void SStats::dispatch( SEventThreadMessage &msg )
 {
-   if ( msg.getId() == STAT_CONSOLIDATE_EVENT ){
-      std::string serializedStast;
-      if(m_serializ_mode == _srBase){
-         std::map<std::string, std::string> keyValues;
-         getConsolidatedPeriodStat(keyValues);
-         addGenerationTimeStamp(keyValues);
-         m_serializer->serialize(keyValues, serializedStast);
-      }
-      else{
-         getSerializedStat(serializedStast);
-      }
+   dispatchDerived(msg);
+}
 
-      if(m_statlogger){
-         m_statlogger->info(serializedStast);
-      }
-      resetStats();
-   }
-   else if ( msg.getId() == STAT_UPDATE_INTERVAL ) {
-      m_idletimer.stop();
-      m_interval = ((UpdateStatInterval&)msg).getInterval();
-      m_idletimer.setInterval( ((UpdateStatInterval&)msg).getInterval() );
-      m_idletimer.start();
+void SStats::handleConsolidate( SEventThreadMessage &msg )
+{
+   std::string serializedStast;
+   if(m_serializ_mode == _srBase){
+      std::map<std::string, std::string> keyValues;
+      getConsolidatedPeriodStat(keyValues);
+      addGenerationTimeStamp(keyValues);
+      m_serializer->serialize(keyValues, serializedStast);
    }
    else{
-      dispatchDerived(msg);
+      getSerializedStat(serializedStast);
    }
+
+   if(m_statlogger){
+      m_statlogger->info(serializedStast);
+   }
+   resetStats();
+   logDispatchStats();
+}
+
+void SStats::handleInterval( UpdateStatInterval &msg )
+{
+   m_idletimer.stop();
+   m_interval = msg.getInterval();
+   m_idletimer.setInterval( m_interval );
+   m_idletimer.start();
+}
+
+void SStats::handleResult( const StatResultData &data )
+{
+   StatResultMessage m( data.type, data.vendor, data.code );
+   dispatchDerived(m);
+}
+
+void SStats::handleAttemp( const StatAttempData &data )
+{
+   StatAttempMessage m( data.type, data.attempType );
+   dispatchDerived(m);
 }
 
 void SStats::addGenerationTimeStamp(std::map<std::string, std::string>& keyValues){
@@ -213,14 +245,40 @@ void SStats::addGenerationTimeStamp(std::map<std::string, std::string>& keyValue
    keyValues["time_utc"] = now_str;
 }
 
+void SStats::addDispatchStats(SEventThread *thread){
+   SMutexLock l( m_dstatsMutex );
+   m_dstatsThreads.push_back( thread );
+}
+
+void SStats::removeDispatchStats(SEventThread *thread){
+   SMutexLock l( m_dstatsMutex );
+   m_dstatsThreads.erase( std::remove( m_dstatsThreads.begin(), m_dstatsThreads.end(), thread ),
+                          m_dstatsThreads.end() );
+}
+
+void SStats::logDispatchStats(){
+   if(m_statlogger == NULL)
+      return;
+
+   SMutexLock l( m_dstatsMutex );
+   SDispatchStatsData data;
+   std::string json;
+
+   for(std::vector<SEventThread*>::iterator it = m_dstatsThreads.begin(); it != m_dstatsThreads.end(); ++it){
+      (*it)->getDispatchStats( data );
+      data.serializeJSON( json );
+      m_statlogger->info(json);
+   }
+}
+
 void SStats::registerStatAttemp(StatType type, StatAttempType attempType){
-   StatAttempMessage *statmsg = new StatAttempMessage(type, attempType);
-   this->postMessage(statmsg);
+   StatAttempData data = { type, attempType };
+   postInline(STAT_ATTEMPT_MSG, data);
 }
 
 void SStats::registerStatResult(StatType type, uint32_t vendor ,uint32_t code){
-   StatResultMessage *statmsg = new StatResultMessage(type, vendor, code);
-   postMessage(statmsg);
+   StatResultData data = { type, vendor, code };
+   postInline(STAT_RSLT_MSG, data);
 }
 
 
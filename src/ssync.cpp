@@ -18,18 +18,121 @@
 
 #include "ssync.h"
 #include "serror.h"
+#include "slockprofile.h"
 
 #include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+static inline long _futex(std::atomic<int> &word, int op, int val, bool shared)
+{
+    return syscall(SYS_futex, reinterpret_cast<int*>(&word),
+        shared ? op : (op | FUTEX_PRIVATE_FLAG), val, NULL, NULL, 0);
+}
+
+static inline void _cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline long _cpuCount()
+{
+    static long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus;
+}
+
+SDeadline::SDeadline(long milliseconds)
+    : mKind(milliseconds > 0 ? dkAbsolute : dkExpired)
+{
+    mTime.tv_sec = 0;
+    mTime.tv_nsec = 0;
+
+    if (mKind == dkAbsolute)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &mTime);
+        mTime.tv_sec += milliseconds / 1000;
+        mTime.tv_nsec += (milliseconds % 1000) * 1000000;
+        if (mTime.tv_nsec >= 1000000000)
+        {
+            mTime.tv_sec++;
+            mTime.tv_nsec -= 1000000000;
+        }
+    }
+}
+
+bool SDeadline::isExpired() const
+{
+    return remaining() == 0;
+}
+
+long SDeadline::remaining() const
+{
+    if (mKind == dkInfinite)
+        return -1;
+    if (mKind == dkExpired)
+        return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ms = (mTime.tv_sec - now.tv_sec) * 1000 + (mTime.tv_nsec - now.tv_nsec) / 1000000;
+
+    if (ms > 0)
+        return ms;
+
+    // less than a millisecond left still counts as not expired
+    return (mTime.tv_sec > now.tv_sec || (mTime.tv_sec == now.tv_sec && mTime.tv_nsec > now.tv_nsec)) ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool SFutex::wait(std::atomic<int> &word, int expected, bool shared)
+{
+    return _futex(word, FUTEX_WAIT, expected, shared) == 0;
+}
+
+bool SFutex::waitUntil(std::atomic<int> &word, int expected, const struct timespec &deadline, bool shared)
+{
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout
+    return syscall(SYS_futex, reinterpret_cast<int*>(&word),
+        shared ? FUTEX_WAIT_BITSET : (FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG),
+        expected, &deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0 || errno != ETIMEDOUT;
+}
+
+int SFutex::wake(std::atomic<int> &word, int count, bool shared)
+{
+    long res = _futex(word, FUTEX_WAKE, count, shared);
+    return res < 0 ? 0 : (int)res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 SMutex::SMutex(bool bInit)
-    : mInitialized(false)
+    : mInitialized(false), mType(mtRecursive), mProcessShared(true), mSpinCount(0),
+      mProfile(NULL), mProfileDepth(0), mAcquiredAt(0)
+{
+    if (bInit)
+        init(NULL);
+}
+
+SMutex::SMutex(MutexType type, bool processShared, int spinCount, bool bInit)
+    : mInitialized(false), mType(type), mProcessShared(processShared), mSpinCount(spinCount),
+      mProfile(NULL), mProfileDepth(0), mAcquiredAt(0)
 {
     if (bInit)
         init(NULL);
@@ -42,20 +145,33 @@ SMutex::~SMutex()
 
 void SMutex::init(const char *pName)
 {
+    if (pName)
+        setName(pName);
+
     if (!mInitialized)
     {
         int res;
+        int type;
         pthread_mutexattr_t attr;
 
+        switch (mType)
+        {
+            case mtRecursive:   type = PTHREAD_MUTEX_RECURSIVE;  break;
+            case mtErrorCheck:  type = PTHREAD_MUTEX_ERRORCHECK; break;
+            default:            type = PTHREAD_MUTEX_NORMAL;     break;
+        }
+
         if ((res = pthread_mutexattr_init(&attr)) != 0)
             SError::throwRuntimeExceptionWithErrno("Unable to initialize mutex");
-        else if ((res = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) != 0)
+        else if ((res = pthread_mutexattr_setpshared(&attr, mProcessShared ? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE)) != 0)
             SError::throwRuntimeExceptionWithErrno("Unable to initialize mutex");
-        else if ((res = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE)) != 0)
+        else if ((res = pthread_mutexattr_settype(&attr, type)) != 0)
             SError::throwRuntimeExceptionWithErrno("Unable to initialize mutex");
         else if ((res = pthread_mutex_init(&mMutex, &attr)) != 0)
             SError::throwRuntimeExceptionWithErrno("Unable to initialize mutex");
 
+        pthread_mutexattr_destroy(&attr);
+
         mInitialized = true;
     }
 }
@@ -69,14 +185,69 @@ void SMutex::destroy()
     }
 }
 
+void SMutex::setName(const char *pName)
+{
+    mProfile = SLockProfiler::getProfile(pName);
+}
+
 bool SMutex::enter(bool wait)
+{
+    return enter(wait ? SDeadline() : SDeadline(0));
+}
+
+bool SMutex::enter(const SDeadline &deadline)
 {
     if (!mInitialized)
         SError::throwRuntimeException("SMutex::enter() - SMutex not initialized");
 
-    int res = pthread_mutex_lock(&mMutex);
+    if (mProfile && SLockProfiler::isEnabled())
+    {
+        uint64_t start = SLockProfiler::now();
+        bool contended = pthread_mutex_trylock(&mMutex) != 0;
 
-    if (res != 0 && wait)
+        if (contended && !lock(deadline))
+            return false;
+
+        uint64_t acquired = contended ? SLockProfiler::now() : start;
+
+        // the hold time is measured from the outermost acquisition
+        if (mProfileDepth++ == 0)
+            mAcquiredAt = acquired;
+
+        SLockProfiler::recordAcquire(mProfile, contended, acquired - start);
+
+        return true;
+    }
+
+    return lock(deadline);
+}
+
+bool SMutex::lock(const SDeadline &deadline)
+{
+    bool tryonly = !deadline.isInfinite() && deadline.isExpired();
+
+    if (mSpinCount > 0 && !tryonly && _cpuCount() > 1)
+    {
+        // adaptive, short critical sections are usually released before
+        // the kernel would even have put this thread to sleep
+        for (int i = 0; i < mSpinCount; i++)
+        {
+            if (pthread_mutex_trylock(&mMutex) == 0)
+                return true;
+            _cpuRelax();
+        }
+    }
+
+    int res;
+
+    if (deadline.isInfinite())
+        res = pthread_mutex_lock(&mMutex);
+    else if (tryonly)
+        res = pthread_mutex_trylock(&mMutex);
+    else
+        res = pthread_mutex_clocklock(&mMutex, CLOCK_MONOTONIC, &deadline.getTimespec());
+
+    if (res != 0 && res != EBUSY && res != ETIMEDOUT)
         SError::throwRuntimeExceptionWithErrno("SMutex::enter() - Unable to lock mutex", res);
 
     return res == 0;
@@ -87,24 +258,114 @@ void SMutex::leave()
     if (!mInitialized)
         SError::throwRuntimeException("SMutex::enter() - SMutex not initialized");
 
+    uint64_t held = 0;
+    bool profiled = mProfileDepth > 0 && --mProfileDepth == 0;
+
+    if (profiled)
+        held = SLockProfiler::now() - mAcquiredAt;
+
     int res = pthread_mutex_unlock(&mMutex);
 
     if (res != 0)
         SError::throwRuntimeExceptionWithErrno("SMutex::enter() - Unable to unlock mutex", res);
+
+    if (profiled)
+        SLockProfiler::recordHold(mProfile, held);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+SRWLock::SRWLock(bool bInit)
+    : mInitialized(false)
+{
+    if (bInit)
+        init();
+}
+
+SRWLock::~SRWLock()
+{
+    destroy();
+}
+
+void SRWLock::init()
+{
+    if (!mInitialized)
+    {
+        pthread_rwlockattr_t attr;
+
+        if (pthread_rwlockattr_init(&attr) != 0)
+            SError::throwRuntimeExceptionWithErrno("Unable to initialize rwlock");
+
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+        int res = pthread_rwlock_init(&mLock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+
+        if (res != 0)
+            SError::throwRuntimeExceptionWithErrno("Unable to initialize rwlock", res);
+
+        mInitialized = true;
+    }
+}
+
+void SRWLock::destroy()
+{
+    if (mInitialized)
+    {
+        pthread_rwlock_destroy(&mLock);
+        mInitialized = false;
+    }
+}
+
+bool SRWLock::enterRead(bool wait)
+{
+    if (!mInitialized)
+        SError::throwRuntimeException("SRWLock::enterRead() - SRWLock not initialized");
+
+    int res = wait ? pthread_rwlock_rdlock(&mLock) : pthread_rwlock_tryrdlock(&mLock);
+
+    if (res != 0 && wait)
+        SError::throwRuntimeExceptionWithErrno("SRWLock::enterRead() - Unable to lock", res);
+
+    return res == 0;
+}
+
+bool SRWLock::enterWrite(bool wait)
+{
+    if (!mInitialized)
+        SError::throwRuntimeException("SRWLock::enterWrite() - SRWLock not initialized");
+
+    int res = wait ? pthread_rwlock_wrlock(&mLock) : pthread_rwlock_trywrlock(&mLock);
+
+    if (res != 0 && wait)
+        SError::throwRuntimeExceptionWithErrno("SRWLock::enterWrite() - Unable to lock", res);
+
+    return res == 0;
+}
+
+void SRWLock::leave()
+{
+    if (!mInitialized)
+        SError::throwRuntimeException("SRWLock::leave() - SRWLock not initialized");
+
+    int res = pthread_rwlock_unlock(&mLock);
+
+    if (res != 0)
+        SError::throwRuntimeExceptionWithErrno("SRWLock::leave() - Unable to unlock", res);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 SSemaphore::SSemaphore()
+    : mInitialized(false), mShared(false), mInitialCount(0), mMaxCount(0), mValue(0), mWaiters(0)
 {
-    mInitialized = false;
 }
 
 SSemaphore::SSemaphore(unsigned int lInitialCount, unsigned int lMaxCount, const char *pszName, bool bInit)
+    : mInitialized(false), mShared(false), mInitialCount(0), mMaxCount(0), mValue(0), mWaiters(0)
 {
-    mInitialized = false;
-
     if (bInit)
         init(lInitialCount, lMaxCount, pszName);
 }
@@ -119,20 +380,20 @@ void SSemaphore::init(unsigned int lInitialCount, unsigned int lMaxCount, const
     if (mInitialized)
         SError::throwRuntimeException("Semaphore already initialized");
 
+    if (lMaxCount == 0 || lMaxCount > INT_MAX)
+        lMaxCount = INT_MAX;
+
+    if (lInitialCount > lMaxCount)
+        SError::throwRuntimeException("Semaphore initial count exceeds the max count");
+
     if (pszName != NULL)
         mName = pszName;
 
+    mShared = pszName != NULL;
     mInitialCount = lInitialCount;
-    mCurrCount = lInitialCount;
     mMaxCount = lMaxCount;
-
-    int res;
-
-    if (sem_init(&mSem, (pszName != NULL) ? 1 : 0, lMaxCount) != 0)
-        SError::throwRuntimeExceptionWithErrno("Error initializing semaphore");
-
-    for (int i = lMaxCount; i > lInitialCount; i--)
-        sem_wait(&mSem);
+    mWaiters.store(0, std::memory_order_relaxed);
+    mValue.store(lInitialCount, std::memory_order_release);
 
     mInitialized = true;
 }
@@ -142,10 +403,9 @@ void SSemaphore::destroy()
     if (mInitialized)
     {
         mInitialCount = 0;
-        mCurrCount = 0;
         mMaxCount = 0;
+        mValue.store(0, std::memory_order_relaxed);
 
-        sem_destroy(&mSem);
         mInitialized = false;
     }
     else
@@ -154,28 +414,50 @@ void SSemaphore::destroy()
     }
 }
 
-bool SSemaphore::decrement(bool wait)
+bool SSemaphore::tryAcquire()
 {
-    int res;
+    int val = mValue.load(std::memory_order_relaxed);
+
+    while (val > 0)
+    {
+        if (mValue.compare_exchange_weak(val, val - 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return true;
+    }
+
+    return false;
+}
 
-    if (!wait)
+bool SSemaphore::decrement(bool wait)
+{
+    while (!tryAcquire())
     {
-        int val = 0;
-        if (sem_getvalue(&mSem, &val) != 0)
-            SError::throwRuntimeExceptionWithErrno("Error retrieving semaphore value");
-        if (val == 0)
+        if (!wait)
             return false;
+
+        mWaiters.fetch_add(1, std::memory_order_seq_cst);
+        SFutex::wait(mValue, 0, mShared);
+        mWaiters.fetch_sub(1, std::memory_order_relaxed);
     }
 
-    while (true)
+    return true;
+}
+
+bool SSemaphore::decrement(const SDeadline &deadline)
+{
+    if (deadline.isInfinite())
+        return decrement(true);
+
+    while (!tryAcquire())
     {
-       if (sem_wait(&mSem) != 0)
-       {
-          if (errno == 4)
-             continue;
-          SError::throwRuntimeExceptionWithErrno("Error waiting for semaphore");
-       }
-       break;
+        if (deadline.isExpired())
+            return false;
+
+        mWaiters.fetch_add(1, std::memory_order_seq_cst);
+        bool signaled = SFutex::waitUntil(mValue, 0, deadline.getTimespec(), mShared);
+        mWaiters.fetch_sub(1, std::memory_order_relaxed);
+
+        if (!signaled)
+            return tryAcquire();
     }
 
     return true;
@@ -183,8 +465,17 @@ bool SSemaphore::decrement(bool wait)
 
 bool SSemaphore::increment()
 {
-    if (sem_post(&mSem) != 0)
-        SError::throwRuntimeExceptionWithErrno("Error incrementing semaphore");
+    int val = mValue.load(std::memory_order_relaxed);
+
+    do
+    {
+        if ((unsigned int)val >= mMaxCount)
+            return false;
+    }
+    while (!mValue.compare_exchange_weak(val, val + 1, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+    if (mWaiters.load(std::memory_order_seq_cst) > 0)
+        SFutex::wake(mValue, 1, mShared);
 
     return true;
 }
@@ -192,14 +483,24 @@ bool SSemaphore::increment()
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-SEvent::SEvent( bool state )
+static int _elapsedRemaining( const struct timespec &start, int ms )
 {
-   m_pipefd[0] = -1;
-   m_pipefd[1] = -1;
+   if ( ms < 0 )
+      return -1;
+
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+
+   long elapsed = ( now.tv_sec - start.tv_sec ) * 1000 + ( now.tv_nsec - start.tv_nsec ) / 1000000;
 
-   int result = pipe2( m_pipefd, O_NONBLOCK );
-   if ( result == -1 )
-      SError::throwRuntimeExceptionWithErrno("Error createing pipe (SEvent)");
+   return elapsed >= ms ? 0 : ms - (int)elapsed;
+}
+
+SEvent::SEvent( bool state )
+{
+   m_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   if ( m_fd == -1 )
+      SError::throwRuntimeExceptionWithErrno("Error creating eventfd (SEvent)");
 
    if ( state )
       set();
@@ -207,27 +508,34 @@ SEvent::SEvent( bool state )
 
 SEvent::~SEvent()
 {
-   closepipe();
+   closefd();
 }
 
 void SEvent::set()
 {
-   write( m_pipefd[1], &m_buf, 1 );
+   uint64_t val = 1;
+   // the counter only has to be non-zero, EAGAIN on overflow is harmless
+   (void)write( m_fd, &val, sizeof(val) );
 }
 
 void SEvent::reset()
 {
-   while ( read(m_pipefd[0], &m_buf, sizeof(m_buf)) > 0 );
+   uint64_t val;
+   // a single read returns and clears the whole counter
+   (void)read( m_fd, &val, sizeof(val) );
 }
 
 bool SEvent::wait( int ms )
 {
    bool rval = false;
-   struct pollfd fds[] = { { .fd = m_pipefd[0], .events = POLLRDNORM } };
+   struct pollfd fds[] = { { .fd = m_fd, .events = POLLIN } };
+   struct timespec start;
+
+   clock_gettime( CLOCK_MONOTONIC, &start );
 
    while (true)
    {
-      int result = poll( fds, 1, ms );
+      int result = poll( fds, 1, _elapsedRemaining( start, ms ) );
       if ( result > 0 ) // event set
       {
          rval = true;
@@ -247,16 +555,87 @@ bool SEvent::wait( int ms )
    return rval;
 }
 
-void SEvent::closepipe()
+int SEvent::waitAny( SEvent **events, size_t count, int ms )
 {
-   if ( m_pipefd[0] != -1 )
+   std::vector<struct pollfd> fds( count );
+   struct timespec start;
+
+   for ( size_t i = 0; i < count; i++ )
    {
-      close( m_pipefd[0] );
-      m_pipefd[0] = -1;
+      fds[i].fd = events[i]->m_fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
    }
-   if ( m_pipefd[1] != -1 )
+
+   clock_gettime( CLOCK_MONOTONIC, &start );
+
+   while ( true )
+   {
+      int result = poll( fds.data(), count, _elapsedRemaining( start, ms ) );
+      if ( result > 0 ) // event set
+      {
+         for ( size_t i = 0; i < count; i++ )
+         {
+            if ( fds[i].revents & POLLIN )
+               return (int)i;
+         }
+      }
+      else if ( result < 0 && errno == EINTR )
+      {
+         continue;
+      }
+
+      // timeout
+      return -1;
+   }
+}
+
+bool SEvent::waitAll( SEvent **events, size_t count, int ms )
+{
+   std::vector<struct pollfd> fds;
+   struct timespec start;
+
+   for ( size_t i = 0; i < count; i++ )
+   {
+      struct pollfd pfd = { events[i]->m_fd, POLLIN, 0 };
+      fds.push_back( pfd );
+   }
+
+   clock_gettime( CLOCK_MONOTONIC, &start );
+
+   while ( !fds.empty() )
+   {
+      int result = poll( fds.data(), fds.size(), _elapsedRemaining( start, ms ) );
+      if ( result > 0 )
+      {
+         // stop polling the events that have been seen set
+         for ( size_t i = fds.size(); i-- > 0; )
+         {
+            if ( fds[i].revents & POLLIN )
+               fds.erase( fds.begin() + i );
+            else
+               fds[i].revents = 0;
+         }
+      }
+      else if ( result < 0 && errno == EINTR )
+      {
+         continue;
+      }
+      else
+      {
+         // timeout
+         return false;
+      }
+   }
+
+   return true;
+}
+
+void SEvent::closefd()
+{
+   if ( m_fd != -1 )
    {
-      close( m_pipefd[1] );
-      m_pipefd[1] = -1;
+      close( m_fd );
+      m_fd = -1;
    }
 }
@@ -17,22 +17,31 @@
 #include "sthread.h"
 #include "serror.h"
 #include "satomic.h"
+#include "stime.h"
 
 #include <sched.h>
 #include <time.h>
 #include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 
 #include <iostream>
+#include <vector>
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
 SThread::SThread( bool selfDestruct )
-   : mSuspended(0, 1000), mSuspendSem(0, 1)
+   : mLifecycleSeq(0)
 {
    mSelfDestruct = selfDestruct;
    mState = SThread::rsWaitingToRun;
+   mLifecycle = lcIdle;
    mSuspendCnt = 1;
    mArg = NULL;
    mExitCode = 0;
@@ -40,6 +49,7 @@ SThread::SThread( bool selfDestruct )
    mUpdateStateManually = false;
 
    mInitialized = false;
+   mJoined = false;
 }
 
 SThread::~SThread()
@@ -53,14 +63,14 @@ SThread::~SThread()
 
 void SThread::_shutdown()
 {
-   SMutexLock l(mMutex);
-
    if (isRunning())
-   {
-      suspend();
       shutdown();
-      resume();
-   }
+}
+
+void SThread::init(void *arg, const SThreadOptions &options, bool suspended)
+{
+   setOptions(options);
+   init(arg, suspended);
 }
 
 void SThread::init(void *arg, bool suspended)
@@ -79,8 +89,54 @@ void SThread::init(void *arg, bool suspended)
       pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
       pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-      if (pthread_create(&mThread, &attr, _threadProc, (void *)this) != 0)
-         SError::throwRuntimeExceptionWithErrno("Error initializing thread");
+      int rc = 0;
+
+      if (mOptions.stackSize > 0)
+      {
+         size_t stackSize = mOptions.stackSize < (size_t)PTHREAD_STACK_MIN ? (size_t)PTHREAD_STACK_MIN : mOptions.stackSize;
+         rc = pthread_attr_setstacksize(&attr, stackSize);
+      }
+
+      if (rc == 0 && mOptions.policy != SCHED_OTHER)
+      {
+         sched_param param;
+         param.sched_priority = mOptions.priority;
+
+         rc = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+         if (rc == 0)
+            rc = pthread_attr_setschedpolicy(&attr, mOptions.policy);
+         if (rc == 0)
+            rc = pthread_attr_setschedparam(&attr, &param);
+      }
+
+      if (rc == 0 && !mOptions.cpus.empty())
+      {
+         cpu_set_t cpus;
+         CPU_ZERO(&cpus);
+         for (std::vector<int>::const_iterator it = mOptions.cpus.begin(); it != mOptions.cpus.end(); ++it)
+         {
+            if (*it < 0 || *it >= CPU_SETSIZE)
+            {
+               pthread_attr_destroy(&attr);
+               SError::throwRuntimeException("Invalid cpu %d in the thread options", *it);
+            }
+            CPU_SET(*it, &cpus);
+         }
+         rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+      }
+
+      if (rc != 0)
+      {
+         pthread_attr_destroy(&attr);
+         SError::throwRuntimeExceptionWithErrno("Invalid thread options", rc);
+      }
+
+      // EPERM here usually means SCHED_FIFO/SCHED_RR without CAP_SYS_NICE
+      rc = pthread_create(&mThread, &attr, _threadProc, (void *)this);
+      pthread_attr_destroy(&attr);
+
+      if (rc != 0)
+         SError::throwRuntimeExceptionWithErrno("Error initializing thread", rc);
 
       mInitialized = true;
 
@@ -90,8 +146,11 @@ void SThread::init(void *arg, bool suspended)
       resume();
    }
 
-   while (mSuspendCnt == 0 && isWaitingToRun())
-      yield();
+   // until the thread is past its start, unless it is held suspended
+   waitLifecycle([this]() {
+      return mLifecycle == lcRunning || mLifecycle == lcFinished ||
+             (mLifecycle == lcParked && mSuspendCnt > 0);
+   });
 }
 
 bool SThread::isInitialized()
@@ -102,54 +161,156 @@ bool SThread::isInitialized()
 void SThread::resume()
 {
    if (!isInitialized())
-      SError::throwRuntimeException("The semaphore is not initialized");
+      SError::throwRuntimeException("The thread is not initialized");
 
+   SMutexLock l(mMutex);
+
+   if (mSuspendCnt > 0)
    {
-      if (mSuspendCnt > 0)
-      {
-         mSuspendCnt--;
-         if (mSuspendCnt == 0)
-         {
-            mSuspendSem.increment();
-         }
-      }
+      mSuspendCnt--;
+      if (mSuspendCnt == 0)
+         setLifecycle(mLifecycle);
    }
-
-   yield();
 }
 
 void SThread::suspend()
 {
-   int suspendCnt;
+   if (beginSuspend())
+      waitSuspended();
+}
+
+bool SThread::beginSuspend()
+{
+   SMutexLock l(mMutex);
+   mSuspendCnt++;
+   return mSuspendCnt == 1;
+}
+
+void SThread::waitSuspended()
+{
+   waitLifecycle([this]() {
+      return mLifecycle != lcRunning || mSuspendCnt == 0;
+   });
+}
+
+void SThread::_suspend()
+{
+   park();
+}
 
+//
+// blocks the calling thread, which must be this thread, until the suspend
+// count is back to zero.  The thread is marked running under the same lock
+// as the last check of the count, so a suspend() that comes in after it
+// waits for the thread to park again.
+//
+void SThread::park()
+{
    {
       SMutexLock l(mMutex);
-      mSuspendCnt++;
-      suspendCnt = mSuspendCnt;
+      if (mSuspendCnt == 0)
+      {
+         setRunning();
+         return;
+      }
+      setLifecycle(lcParked);
    }
 
-   if (suspendCnt == 1)
-      mSuspended.decrement();
+   waitLifecycle([this]() { return mSuspendCnt == 0; },
+                 [this]() { setRunning(); });
 }
 
-void SThread::_suspend()
+// called with mMutex held
+void SThread::setRunning()
 {
-   mSuspended.increment();
-   mSuspendSem.decrement();
+   if (!mUpdateStateManually)
+      mState = SThread::rsRunning;
+   setLifecycle(lcRunning);
+}
+
+// called with mMutex held, the same state again just wakes the waiters
+void SThread::setLifecycle(Lifecycle lc)
+{
+   mLifecycle = lc;
+   mLifecycleSeq.fetch_add(1, std::memory_order_release);
+   SFutex::wake(mLifecycleSeq, INT_MAX);
+}
+
+//
+// waits until done() holds, done() is evaluated with mMutex held.  The
+// sequence is read before the check so a change made after the check
+// makes the futex wait return straight away.
+//
+template <class P>
+void SThread::waitLifecycle(P done)
+{
+   waitLifecycle(done, []() {});
+}
+
+// then() runs under the lock that saw done() hold
+template <class P, class A>
+void SThread::waitLifecycle(P done, A then)
+{
+   while (true)
+   {
+      int seq = mLifecycleSeq.load(std::memory_order_acquire);
+
+      {
+         SMutexLock l(mMutex);
+         if (done())
+         {
+            then();
+            return;
+         }
+      }
+
+      SFutex::wait(mLifecycleSeq, seq);
+   }
 }
 
 void SThread::join()
 {
    {
       SMutexLock l(mMutex);
-      if (!isRunning() && !isSuspended())
+      // a thread that has already finished still has to be joined, the
+      // caller may free this object as soon as join() returns
+      if (!isInitialized() || mJoined)
          return;
+      mJoined = true;
    }
 
    void *value;
    pthread_join(mThread, &value);
 }
 
+//
+// the name and the memory policy can only be set once the thread is
+// running, a failure here is not fatal since the thread is already up
+//
+void SThread::applyOptions()
+{
+   if (!mOptions.name.empty())
+   {
+      // the kernel keeps 15 characters plus the terminator
+      std::string name = mOptions.name.substr(0, 15);
+      pthread_setname_np(pthread_self(), name.c_str());
+   }
+
+   if (mOptions.numaNode >= 0)
+   {
+      // MPOL_BIND from <numaif.h>, called directly to avoid linking libnuma
+      const int mpolBind = 2;
+      const size_t bits = sizeof(unsigned long) * 8;
+      unsigned long nodemask[16] = { 0 };
+
+      if ((size_t)mOptions.numaNode < bits * (sizeof(nodemask) / sizeof(nodemask[0])))
+      {
+         nodemask[mOptions.numaNode / bits] |= 1UL << (mOptions.numaNode % bits);
+         syscall(SYS_set_mempolicy, mpolBind, nodemask, bits * (sizeof(nodemask) / sizeof(nodemask[0])) + 1);
+      }
+   }
+}
+
 void SThread::sleep(int milliseconds)
 {
    timespec tmReq;
@@ -170,15 +331,10 @@ void *SThread::_threadProc(void *arg)
 {
    SThread *ths = (SThread*)arg;
 
-   // do not continue until resumed
-   ths->mSuspendSem.decrement();
+   ths->applyOptions();
 
-   // set to running state
-   {
-      SMutexLock l(ths->mMutex);
-      if (!ths->getUpdateStateManually())
-         ths->mState = SThread::rsRunning;
-   }
+   // do not continue until resumed, this sets the running state
+   ths->park();
 
    unsigned long ret = ths->threadProc(ths->mArg);
 
@@ -187,6 +343,7 @@ void *SThread::_threadProc(void *arg)
       SMutexLock l(ths->mMutex);
       if (!ths->getUpdateStateManually())
          ths->mState = SThread::rsDoneRunning;
+      ths->setLifecycle(lcFinished);
    }
 
    if ( ths->mSelfDestruct )
@@ -216,39 +373,163 @@ void SThread::cancelWait()
 
 
 SEventThread::SEventThread( bool selfDestruct )
-   : SThread( selfDestruct )
+   : SThread( selfDestruct ),
+     m_timers( getTick() ),
+     m_scheduled( getTick() ),
+     m_nexthandle( 0 ),
+     m_firing( NULL ),
+     m_stopWaiters( 0 ),
+     m_firedSeq( 0 ),
+     m_wakeup( false ),
+     m_drain( false ),
+     m_stopped( false ),
+     m_batchsize( SEVENTTHREAD_DEFAULT_BATCH_SIZE ),
+     m_idletimeout( 0 ),
+     m_loopmode( lmQueue ),
+     m_epollfd( -1 ),
+     m_eventfd( -1 )
 {
+   // lane 0 for user messages, lane 1 for priority messages, the control
+   // messages use the queue's control list (see pushEntry())
+   m_events.setLanes( 2 );
 }
 
 SEventThread::~SEventThread()
 {
+   {
+      SMutexLock l( m_timerMutex );
+      m_timers.clear();
+      m_scheduled.clear();
+
+      for ( std::unordered_map<uint64_t,ScheduledPost*>::iterator it = m_posts.begin(); it != m_posts.end(); ++it )
+      {
+         it->second->entry.discard();
+         delete it->second;
+      }
+      m_posts.clear();
+   }
+
+   m_events.setNotifyFd( -1 );
+
+   for ( std::map<int,FdWatch*>::iterator it = m_fdwatches.begin(); it != m_fdwatches.end(); ++it )
+      delete it->second;
+   for ( std::vector<FdWatch*>::iterator it = m_fdretired.begin(); it != m_fdretired.end(); ++it )
+      delete *it;
+   for ( std::vector<Handler*>::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it )
+      delete *it;
+
+   if ( m_eventfd >= 0 )
+      close( m_eventfd );
+   if ( m_epollfd >= 0 )
+      close( m_epollfd );
+}
+
+void SEventThread::init( void *arg, const SThreadOptions &options, bool suspended )
+{
+   setOptions( options );
+   init( arg, suspended );
 }
 
 void SEventThread::init( void *arg, bool suspended )
 {
+   if ( m_loopmode == lmEpoll )
+      initEpoll();
+
    SThread::init( arg, suspended );
    postMessage( ETM_INIT );
 }
 
-void SEventThread::postMessage( uint16_t msg )
+bool SEventThread::postMessage( uint16_t msg )
+{
+   SQueueEntry e;
+   e.set( msg );
+   return postEntry( e, false );
+}
+
+bool SEventThread::postMessage( SEventThreadMessage *msg )
+{
+   SQueueEntry e;
+   e.set( msg );
+   return postEntry( e, false );
+}
+
+bool SEventThread::postPriorityMessage( uint16_t msg )
 {
-   postMessage( new SEventThreadMessage( msg ) );
+   SQueueEntry e;
+   e.set( msg );
+   return postEntry( e, true );
 }
 
-void SEventThread::postMessage( SEventThreadMessage *msg )
+bool SEventThread::postPriorityMessage( SEventThreadMessage *msg )
 {
-   m_events.push( msg );
+   SQueueEntry e;
+   e.set( msg );
+   return postEntry( e, true );
 }
 
-void SEventThread::quit()
+bool SEventThread::postEntry( const SQueueEntry &entry, bool priority, bool control )
 {
-   postMessage( ETM_QUIT );
+   if ( m_dstats.isEnabled() )
+   {
+      SQueueEntry e( entry );
+      e.stamp = SDispatchStats::stamp();
+      return pushEntry( e, priority, control );
+   }
+
+   return pushEntry( entry, priority, control );
+}
+
+bool SEventThread::pushEntry( const SQueueEntry &entry, bool priority, bool control )
+{
+   if ( control && entry.id < ETM_USER )
+      return m_events.pushUrgent( entry );
+
+   if ( !m_events.pushLane( entry, priority ? m_events.getLanes() - 1 : 0 ) )
+   {
+      delete entry.msg;
+      return false;
+   }
+
+   return true;
+}
+
+void SEventThread::getDispatchStats( SDispatchStatsData &data )
+{
+   m_dstats.snapshot( data );
+   data.name = getOptions().name;
+   data.queueDepth = m_events.getSize();
+   data.queuePeak = m_events.getHighWaterMark();
+   data.dropped = m_events.getDropped();
+}
+
+void SEventThread::resetDispatchStats()
+{
+   m_dstats.reset();
+   m_events.resetHighWaterMark();
+}
+
+void SEventThread::quit( bool drain )
+{
+   if ( drain )
+   {
+      // the loop checks for the drain each time around
+      m_drain.store( true, std::memory_order_release );
+      postMessage( ETM_DRAIN );
+   }
+   else
+   {
+      postMessage( ETM_QUIT );
+   }
 }
 
 void SEventThread::suspend()
 {
-   postMessage( ETM_SUSPEND );
-   SThread::suspend();
+   // counted first so the thread parks when it gets to ETM_SUSPEND
+   if ( beginSuspend() )
+   {
+      postMessage( ETM_SUSPEND );
+      waitSuspended();
+   }
 }
 
 void SEventThread::initTimer( SEventThread::Timer &t )
@@ -256,6 +537,417 @@ void SEventThread::initTimer( SEventThread::Timer &t )
    t.init( this );
 }
 
+namespace
+{
+__thread SEventThread *tlsEventThread = NULL;
+}
+
+void SEventThread::initEpoll()
+{
+   if ( m_epollfd >= 0 )
+      return;
+
+   m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+   if ( m_epollfd < 0 )
+      SError::throwRuntimeExceptionWithErrno( "Unable to create the epoll instance" );
+
+   m_eventfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   if ( m_eventfd < 0 )
+      SError::throwRuntimeExceptionWithErrno( "Unable to create the queue eventfd" );
+
+   // the eventfd is the only registration without an FdWatch
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if ( epoll_ctl( m_epollfd, EPOLL_CTL_ADD, m_eventfd, &ev ) < 0 )
+      SError::throwRuntimeExceptionWithErrno( "Unable to watch the queue eventfd" );
+
+   m_events.setNotifyFd( m_eventfd );
+}
+
+void SEventThread::checkLoopThread( const char *method )
+{
+   if ( m_loopmode != lmEpoll )
+      SError::throwRuntimeException( "SEventThread::%s() - the thread is not in lmEpoll mode", method );
+   if ( isInitialized() && tlsEventThread != this )
+      SError::throwRuntimeException( "SEventThread::%s() - called from another thread", method );
+}
+
+void SEventThread::registerFd( int fd, FdCallback onReadable, FdCallback onWritable )
+{
+   checkLoopThread( "registerFd" );
+   initEpoll();
+
+   struct epoll_event ev;
+   ev.events = 0;
+   if ( onReadable )
+      ev.events |= EPOLLIN | EPOLLRDHUP;
+   if ( onWritable )
+      ev.events |= EPOLLOUT;
+
+   FdWatch *w = new FdWatch;
+   w->fd = fd;
+   w->onReadable = onReadable;
+   w->onWritable = onWritable;
+   ev.data.ptr = w;
+
+   std::map<int,FdWatch*>::iterator it = m_fdwatches.find( fd );
+   if ( it != m_fdwatches.end() )
+   {
+      if ( epoll_ctl( m_epollfd, EPOLL_CTL_MOD, fd, &ev ) < 0 )
+      {
+         delete w;
+         SError::throwRuntimeExceptionWithErrno( "Unable to modify the fd watch" );
+      }
+
+      // the old callbacks may be running, the fd registered again from
+      // one of them, so the old watch is retired like unregisterFd() does
+      it->second->fd = -1;
+      m_fdretired.push_back( it->second );
+      it->second = w;
+      return;
+   }
+
+   if ( epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+   {
+      delete w;
+      SError::throwRuntimeExceptionWithErrno( "Unable to watch the fd" );
+   }
+
+   m_fdwatches[fd] = w;
+}
+
+void SEventThread::unregisterFd( int fd )
+{
+   checkLoopThread( "unregisterFd" );
+
+   std::map<int,FdWatch*>::iterator it = m_fdwatches.find( fd );
+   if ( it == m_fdwatches.end() )
+      return;
+
+   // the fd may already be closed, which removed it from the epoll set
+   epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, NULL );
+
+   // events for it may still be pending in the batch being handled
+   it->second->fd = -1;
+   m_fdretired.push_back( it->second );
+   m_fdwatches.erase( it );
+}
+
+size_t SEventThread::pollEvents( SQueueEntry *entries, size_t max, uint64_t wakeAt, bool &active )
+{
+   size_t cnt = m_events.popBatch( entries, max, SDeadline( 0 ) );
+
+   active = false;
+
+   // with messages waiting the fds are only polled, otherwise sleep until
+   // a message, an fd, the next timer or the idle timeout
+   int timeout = 0;
+   bool armed = false;
+
+   if ( cnt > 0 )
+   {
+      if ( m_fdwatches.empty() )
+         return cnt;
+   }
+   else if ( ( armed = m_events.armNotify() ) )
+   {
+      if ( wakeAt == 0 )
+      {
+         timeout = -1;
+      }
+      else
+      {
+         uint64_t now = getTick();
+         timeout = wakeAt <= now ? 0 : wakeAt - now > INT_MAX ? INT_MAX : (int)( wakeAt - now );
+      }
+   }
+
+   struct epoll_event events[SEVENTTHREAD_EPOLL_EVENTS];
+   int n = epoll_wait( m_epollfd, events, SEVENTTHREAD_EPOLL_EVENTS, timeout );
+
+   if ( armed )
+      m_events.disarmNotify();
+
+   if ( n < 0 && errno != EINTR )
+      SError::throwRuntimeExceptionWithErrno( "epoll_wait() failed" );
+
+   for ( int i = 0; i < n; i++ )
+   {
+      FdWatch *w = (FdWatch*)events[i].data.ptr;
+
+      if ( w == NULL )
+      {
+         uint64_t value;
+         ssize_t rc = read( m_eventfd, &value, sizeof(value) );
+         (void)rc;
+         continue;
+      }
+
+      active = true;
+
+      if ( w->fd >= 0 && w->onReadable && ( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP ) ) )
+         w->onReadable( w->fd );
+
+      if ( w->fd >= 0 && w->onWritable && ( events[i].events & ( EPOLLOUT | EPOLLERR ) ) )
+         w->onWritable( w->fd );
+   }
+
+   for ( std::vector<FdWatch*>::iterator it = m_fdretired.begin(); it != m_fdretired.end(); ++it )
+      delete *it;
+   m_fdretired.clear();
+
+   if ( cnt == 0 )
+      cnt = m_events.popBatch( entries, max, SDeadline( 0 ) );
+
+   return cnt;
+}
+
+void SEventThread::startTimer( Timer &t )
+{
+   // a zero interval disarms the timer, as it did with timer_settime()
+   if ( t.m_interval <= 0 )
+   {
+      stopTimer( t );
+      return;
+   }
+
+   {
+      SMutexLock l( m_timerMutex );
+      m_timers.start( t, getTick() + t.m_interval );
+   }
+
+   // the dispatch loop may be asleep with a later deadline
+   if ( tlsEventThread != this && !m_wakeup.exchange( true ) )
+      postMessage( ETM_WAKEUP );
+}
+
+//
+// from another thread this waits for the timer's onTimer() in progress, if
+// any, so the caller may destroy the timer once it returns
+//
+void SEventThread::stopTimer( Timer &t )
+{
+   int seq;
+
+   {
+      SMutexLock l( m_timerMutex );
+      m_timers.stop( t );
+
+      if ( m_firing != &t || tlsEventThread == this )
+         return;
+
+      m_stopWaiters++;
+      seq = m_firedSeq.load( std::memory_order_acquire );
+   }
+
+   while ( true )
+   {
+      SFutex::wait( m_firedSeq, seq );
+
+      SMutexLock l( m_timerMutex );
+      if ( m_firing != &t )
+      {
+         m_stopWaiters--;
+         return;
+      }
+      seq = m_firedSeq.load( std::memory_order_acquire );
+   }
+}
+
+bool SEventThread::expireTimers( uint64_t now )
+{
+   bool fired = false;
+
+   while ( true )
+   {
+      Timer *t;
+
+      {
+         SMutexLock l( m_timerMutex );
+
+         STimerWheelNode *node = m_timers.expire( now );
+         if ( !node )
+            break;
+
+         t = static_cast<Timer*>( node );
+
+         // rearmed before onTimer() so the handler can stop it, periods
+         // missed while the thread was busy are skipped
+         if ( !t->m_oneshot )
+         {
+            uint64_t interval = t->m_interval;
+            uint64_t next = t->getExpiry() + interval;
+            if ( next <= now )
+               next += ( ( now - next ) / interval + 1 ) * interval;
+            m_timers.start( *t, next );
+         }
+
+         m_firing = t;
+      }
+
+      onTimer( *t );
+      fired = true;
+
+      bool wake;
+
+      {
+         SMutexLock l( m_timerMutex );
+         m_firing = NULL;
+         wake = m_stopWaiters > 0;
+         if ( wake )
+            m_firedSeq.fetch_add( 1, std::memory_order_release );
+      }
+
+      if ( wake )
+         SFutex::wake( m_firedSeq, INT_MAX );
+   }
+
+   return fired;
+}
+
+namespace
+{
+
+// wall clock to delay, rounded up so the message is never early
+long millisecondsUntil( const STime &at )
+{
+   STime when( at );
+   STime now = STime::Now();
+
+   if ( when <= now )
+      return 0;
+
+   const timeval &w = when.getTimeVal();
+   const timeval &n = now.getTimeVal();
+   int64_t us = ( (int64_t)w.tv_sec - n.tv_sec ) * 1000000 + ( w.tv_usec - n.tv_usec );
+   return (long)( ( us + 999 ) / 1000 );
+}
+
+}
+
+uint64_t SEventThread::postMessageAfter( long milliseconds, uint16_t message )
+{
+   SQueueEntry e;
+   e.set( message );
+   return schedule( milliseconds, e );
+}
+
+uint64_t SEventThread::postMessageAfter( long milliseconds, SEventThreadMessage *msg )
+{
+   SQueueEntry e;
+   e.set( msg );
+   return schedule( milliseconds, e );
+}
+
+uint64_t SEventThread::postMessageAt( const STime &at, uint16_t message )
+{
+   return postMessageAfter( millisecondsUntil( at ), message );
+}
+
+uint64_t SEventThread::postMessageAt( const STime &at, SEventThreadMessage *msg )
+{
+   return postMessageAfter( millisecondsUntil( at ), msg );
+}
+
+uint64_t SEventThread::schedule( long milliseconds, const SQueueEntry &entry )
+{
+   ScheduledPost *post = new ScheduledPost();
+   post->entry = entry;
+
+   uint64_t handle;
+
+   {
+      SMutexLock l( m_timerMutex );
+      handle = ++m_nexthandle;
+      post->handle = handle;
+      m_posts[handle] = post;
+      m_scheduled.start( *post, getTick() + ( milliseconds > 0 ? milliseconds : 0 ) );
+   }
+
+   // the dispatch loop may be asleep with a later deadline
+   if ( tlsEventThread != this && !m_wakeup.exchange( true ) )
+      postMessage( ETM_WAKEUP );
+
+   return handle;
+}
+
+bool SEventThread::cancelScheduled( uint64_t handle )
+{
+   ScheduledPost *post;
+
+   {
+      SMutexLock l( m_timerMutex );
+
+      std::unordered_map<uint64_t,ScheduledPost*>::iterator it = m_posts.find( handle );
+      if ( it == m_posts.end() )
+         return false;
+
+      post = it->second;
+      m_posts.erase( it );
+      m_scheduled.stop( *post );
+   }
+
+   post->entry.discard();
+   delete post;
+   return true;
+}
+
+size_t SEventThread::getScheduledCount()
+{
+   SMutexLock l( m_timerMutex );
+   return m_posts.size();
+}
+
+bool SEventThread::expireScheduled( uint64_t now, bool &done )
+{
+   bool fired = false;
+
+   while ( !done )
+   {
+      ScheduledPost *post;
+
+      {
+         SMutexLock l( m_timerMutex );
+
+         post = static_cast<ScheduledPost*>( m_scheduled.expire( now ) );
+         if ( !post )
+            break;
+
+         m_posts.erase( post->handle );
+      }
+
+      SQueueEntry &e = post->entry;
+
+      if ( e.msg )
+      {
+         done = dispatchMessage( (SEventThreadMessage*)e.msg, false );
+         delete e.msg;
+      }
+      else
+      {
+         SEventThreadInlineMessage m( e );
+         done = dispatchMessage( &m, true );
+      }
+
+      delete post;
+      fired = true;
+   }
+
+   return fired;
+}
+
+uint64_t SEventThread::getTick()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void SEventThread::dispatch( SEventThreadMessage &msg )
+{
+}
+
 void SEventThread::onInit()
 {
 }
@@ -273,72 +965,242 @@ void SEventThread::onTimer(SEventThread::Timer &ptimer)
 {
 }
 
+void SEventThread::onBatchBegin(size_t count)
+{
+}
+
+void SEventThread::onBatchEnd(size_t count)
+{
+}
+
+void SEventThread::onIdle()
+{
+}
+
+bool SEventThread::isCurrentThread()
+{
+   return tlsEventThread == this;
+}
+
 unsigned long SEventThread::threadProc( void *arg )
 {
+   tlsEventThread = this;
    dispatch();
+   tlsEventThread = NULL;
    return 0;
 }
 
 void SEventThread::dispatch()
 {
+   std::vector<SQueueEntry> batch;
    bool done = false;
+   uint64_t idleAt = 0;
 
    while ( !done )
    {
-     SEventThreadMessage *m = (SEventThreadMessage*)m_events.pop();
+      if ( batch.size() != m_batchsize )
+         batch.resize( m_batchsize );
 
-     if ( m )
-     {
-       switch ( m->getId() )
-       {
-         case ETM_INIT:
-            onInit();
-            break;
-         case ETM_QUIT:
-            done = true;
-            onQuit();
-            break;
-         case ETM_SUSPEND:
-            onSuspend();
-            break;
-         case ETM_TIMER:
-            onTimer( *((STimerMessage*)m)->getTimer() );
-            break;
-         default:
-            dispatch( *m );
+      if ( m_drain.load( std::memory_order_acquire ) && m_events.getSize() == 0 )
+      {
+         m_drain.store( false );
+         onQuit();
+         break;
+      }
+
+      // expiring timers count as activity, like the timer messages did
+      uint64_t now = getTick();
+      if ( expireTimers( now ) )
+         idleAt = 0;
+      if ( expireScheduled( now, done ) )
+         idleAt = 0;
+      if ( done )
+         break;
+
+      long idle = m_idletimeout;
+      if ( idle <= 0 )
+         idleAt = 0;
+      else if ( idleAt == 0 )
+         idleAt = now + idle;
+
+      uint64_t wakeAt = idleAt;
+      uint64_t next;
+
+      {
+         SMutexLock l( m_timerMutex );
+         if ( m_timers.getNextTick( next ) && ( wakeAt == 0 || next < wakeAt ) )
+            wakeAt = next;
+         if ( m_scheduled.getNextTick( next ) && ( wakeAt == 0 || next < wakeAt ) )
+            wakeAt = next;
+      }
+
+      size_t cnt;
+      bool active = false;
+
+      if ( m_loopmode == lmEpoll )
+      {
+         cnt = pollEvents( &batch[0], batch.size(), wakeAt, active );
+      }
+      else
+      {
+         SDeadline deadline;
+         if ( wakeAt != 0 )
+         {
+            struct timespec ts;
+            ts.tv_sec = wakeAt / 1000;
+            ts.tv_nsec = ( wakeAt % 1000 ) * 1000000;
+            deadline = SDeadline( ts );
+         }
+
+         cnt = m_events.popBatch( &batch[0], batch.size(), deadline );
+      }
+
+      size_t idx = 0;
+
+      if ( cnt == 0 )
+      {
+         // fd callbacks count as activity too
+         if ( active )
+            idleAt = 0;
+         else if ( idleAt != 0 && getTick() >= idleAt )
+         {
+            onIdle();
+            idleAt = 0;
+         }
+         continue;
+      }
+
+      idleAt = 0;
+
+      onBatchBegin( cnt );
+
+      // each handler ends where the next one starts, one clock read apiece
+      bool timed = m_dstats.isEnabled();
+      uint64_t start = timed ? SDispatchStats::now() : 0;
+
+      while ( idx < cnt && !done )
+      {
+         SQueueEntry &e = batch[idx++];
+
+         if ( e.msg )
+         {
+            done = dispatchMessage( (SEventThreadMessage*)e.msg, false );
+            delete e.msg;
+         }
+         else
+         {
+            SEventThreadInlineMessage m( e );
+            done = dispatchMessage( &m, true );
+         }
+
+         if ( timed )
+         {
+            uint64_t end = SDispatchStats::now();
+            m_dstats.record( e.id, e.stamp != 0, (uint32_t)( start / 1000 ) - e.stamp, end - start );
+            start = end;
+         }
+      }
+
+      if ( timed )
+         m_dstats.flush();
+
+      onBatchEnd( cnt );
+
+      // anything queued after ETM_QUIT is discarded
+      while ( idx < cnt )
+         batch[idx++].discard();
+   }
+
+   // so is the rest of the backlog, which completes the futures of any
+   // pending call() with an error now rather than when this is destroyed
+   m_stopped.store( true, std::memory_order_release );
+
+   SQueueEntry e;
+   while ( m_events.pop( e, SDeadline( 0 ) ) )
+      e.discard();
+}
+
+bool SEventThread::dispatchMessage( SEventThreadMessage *m, bool byValue )
+{
+   bool done = false;
+
+   switch ( m->getId() )
+   {
+      case ETM_INIT:
+         onInit();
+         break;
+      case ETM_QUIT:
+         done = true;
+         onQuit();
+         break;
+      case ETM_SUSPEND:
+         onSuspend();
+         break;
+      case ETM_TIMER:
+         onTimer( *((STimerMessage*)m)->getTimer() );
+         break;
+      case ETM_WAKEUP:
+         m_wakeup.store( false );
+         break;
+      case ETM_DRAIN:
+         break;
+      case ETM_CALL:
+         ((SEventThreadCallMessage*)m)->run();
+         break;
+      default:
+      {
+         size_t idx = m->getId() - ETM_USER;
+
+         if ( m->getId() >= ETM_USER && idx < m_handlers.size() && m_handlers[idx] &&
+              m_handlers[idx]->invoke( this, *m, byValue ) )
             break;
-       }
 
-       delete m;
-     }
+         dispatch( *m );
+         break;
+      }
+   }
+
+   return done;
+}
+
+void SEventThread::setHandler( uint16_t id, Handler *handler )
+{
+   if ( id < ETM_USER )
+   {
+      delete handler;
+      SError::throwRuntimeException( "SEventThread::on() - message id %u is reserved", (unsigned)id );
    }
+
+   size_t idx = id - ETM_USER;
+
+   if ( idx >= m_handlers.size() )
+      m_handlers.resize( idx + 1, NULL );
+
+   delete m_handlers[idx];
+   m_handlers[idx] = handler;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-long SEventThread::Timer::m_nextid = 0;
+SAtomic<long> SEventThread::Timer::m_nextid( 0 );
 
 SEventThread::Timer::Timer()
 {
    // assign the id
-   m_id = atomic_inc_fetch(m_nextid);
+   m_id = m_nextid.addFetch( 1, std::memory_order_relaxed );
    m_thread = NULL;
    m_interval = 0;
    m_oneshot = true;
-
-   m_timer = NULL;
 }
 
 SEventThread::Timer::Timer(long milliseconds, bool oneshot)
 {
    // assign the id
-   m_id = atomic_inc_fetch(m_nextid);
+   m_id = m_nextid.addFetch( 1, std::memory_order_relaxed );
    m_thread = NULL;
    m_interval = milliseconds;
    m_oneshot = oneshot;
-
-   m_timer = NULL;
 }
 
 SEventThread::Timer::~Timer()
@@ -351,81 +1213,35 @@ void SEventThread::Timer::init(SEventThread* pThread)
    destroy();
 
    m_thread = pThread;
-
-   struct sigevent sev;
-   sev.sigev_notify = SIGEV_SIGNAL;
-   sev.sigev_signo = SIGRTMIN;
-   sev.sigev_value.sival_ptr = this;
-   if (timer_create(CLOCK_REALTIME, &sev, &m_timer) == -1)
-      SError::throwRuntimeExceptionWithErrno( "Unable to initialize timer" );
 }
 
 void SEventThread::Timer::destroy()
 {
-   if (m_timer != NULL)
+   if (m_thread != NULL)
    {
       stop();
-      timer_delete(m_timer);
-      m_timer = NULL;
+      m_thread = NULL;
    }
 }
 
 void SEventThread::Timer::start()
 {
-//std::cout << "SEventThread::Timer::start() 1" << std::endl;
-   if (m_timer == NULL)
+   if (m_thread == NULL)
       SError::throwRuntimeException( "Timer is not initialized" );
 
-   struct itimerspec its;
-   its.it_value.tv_sec = m_interval / 1000; // seconds
-   its.it_value.tv_nsec = (m_interval % 1000) * 1000000; // nano-seconds
-   its.it_interval.tv_sec = m_oneshot ? 0 : its.it_value.tv_sec;
-   its.it_interval.tv_nsec = m_oneshot ? 0 : its.it_value.tv_nsec;
-//std::cout << "SEventThread::Timer::start() 2 - value.tv_sec=" << its.it_value.tv_sec << " value.tv_nsec=" << its.it_value.tv_nsec << " interval.tv_sec=" << its.it_interval.tv_sec << " interval.tv_nsec=" << its.it_interval.tv_nsec << std::endl;
-   if (timer_settime(m_timer, 0, &its, NULL) == -1)
-      SError::throwRuntimeExceptionWithErrno( "Unable to start timer" );
-//std::cout << "SEventThread::Timer::start() 3" << std::endl;
+   m_thread->startTimer( *this );
 }
 
 void SEventThread::Timer::stop()
 {
-   if (m_timer != NULL)
-   {
-      struct itimerspec its;
-      its.it_value.tv_sec = 0; // seconds
-      its.it_value.tv_nsec = 0; // nano-seconds
-      its.it_interval.tv_sec = its.it_value.tv_sec;
-      its.it_interval.tv_nsec = its.it_value.tv_nsec;
-      timer_settime(m_timer, 0, &its, NULL);
-   }
-}
-
-void SEventThread::Timer::_timerHandler(int signo, siginfo_t *pinfo, void *pcontext)
-{
-//std::cout << "SEventThread::Timer::_timerHandler() 1" << std::endl;
-   SEventThread::Timer* pTimer = (SEventThread::Timer*)pinfo->si_value.sival_ptr;
-   if (pTimer)
-   {
-//std::cout << "SEventThread::Timer::_timerHandler() 2" << std::endl;
-      pTimer->m_thread->postMessage( new STimerMessage( pTimer ) );
-   }
+   if (m_thread != NULL)
+      m_thread->stopTimer( *this );
 }
 
-SEventThread::TimerHandler _initTimerHandler;
-
 void SEventThread::TimerHandler::init()
 {
-//std::cout << "SEventThread::TimerHandler::init()" << std::endl;
-   struct sigaction sa;
-   sa.sa_flags = SA_SIGINFO;
-   sa.sa_sigaction = SEventThread::Timer::_timerHandler;
-   sigemptyset(&sa.sa_mask);
-   int signo = SIGRTMIN;
-   if (sigaction(signo, &sa, NULL) == -1)
-      SError::throwRuntimeExceptionWithErrno( "Unable to register timer handler" );
 }
 
 void SEventThread::TimerHandler::uninit()
 {
-//std::cout << "SEventThread::TimerHandler::uninit()" << std::endl;
 }
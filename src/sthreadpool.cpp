@@ -0,0 +1,491 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <limits.h>
+
+#include "sthreadpool.h"
+#include "sthread.h"
+#include "satomic.h"
+#include "serror.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+//
+// Chase-Lev work-stealing deque, with the memory orderings from Le, Pop,
+// Cohen and Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak
+// Memory Models".  Only the owning worker calls push() and take(), any
+// thread may call steal().  An array that is outgrown is kept until the
+// deque is destroyed since a thief may still be reading it.
+//
+class SWorkDeque
+{
+public:
+   SWorkDeque()
+      : m_top( 0 ), m_bottom( 0 )
+   {
+      m_array.store( new Array( 256 ), std::memory_order_relaxed );
+   }
+
+   ~SWorkDeque()
+   {
+      delete m_array.load( std::memory_order_relaxed );
+      for ( std::vector<Array*>::iterator it = m_retired.begin(); it != m_retired.end(); ++it )
+         delete *it;
+   }
+
+   void push( SThreadPoolTask *task )
+   {
+      int64_t b = m_bottom.load( std::memory_order_relaxed );
+      int64_t t = m_top.load( std::memory_order_acquire );
+      Array *a = m_array.load( std::memory_order_relaxed );
+
+      if ( b - t > (int64_t)a->size - 1 )
+         a = grow( a, t, b );
+
+      a->put( b, task );
+      m_bottom.store( b + 1, std::memory_order_release );
+   }
+
+   SThreadPoolTask *take()
+   {
+      int64_t b = m_bottom.load( std::memory_order_relaxed ) - 1;
+      Array *a = m_array.load( std::memory_order_relaxed );
+      m_bottom.store( b, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      int64_t t = m_top.load( std::memory_order_relaxed );
+
+      if ( t > b )
+      {
+         m_bottom.store( b + 1, std::memory_order_relaxed );
+         return NULL;
+      }
+
+      SThreadPoolTask *task = a->get( b );
+      if ( t == b )
+      {
+         // last task, race the thieves for it
+         if ( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+            task = NULL;
+         m_bottom.store( b + 1, std::memory_order_relaxed );
+      }
+
+      return task;
+   }
+
+   // returns NULL if the deque is empty or another thread won the race
+   SThreadPoolTask *steal()
+   {
+      int64_t t = m_top.load( std::memory_order_acquire );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      int64_t b = m_bottom.load( std::memory_order_acquire );
+
+      if ( t >= b )
+         return NULL;
+
+      Array *a = m_array.load( std::memory_order_acquire );
+      SThreadPoolTask *task = a->get( t );
+      if ( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+         return NULL;
+
+      return task;
+   }
+
+   bool isEmpty()
+   {
+      return m_top.load( std::memory_order_relaxed ) >= m_bottom.load( std::memory_order_relaxed );
+   }
+
+private:
+   struct Array
+   {
+      Array( size_t n ) : size( n ), mask( n - 1 ), tasks( new std::atomic<SThreadPoolTask*>[n] ) {}
+      ~Array() { delete [] tasks; }
+
+      SThreadPoolTask *get( int64_t i ) { return tasks[i & mask].load( std::memory_order_relaxed ); }
+      void put( int64_t i, SThreadPoolTask *task ) { tasks[i & mask].store( task, std::memory_order_relaxed ); }
+
+      size_t size;
+      size_t mask;
+      std::atomic<SThreadPoolTask*> *tasks;
+   };
+
+   Array *grow( Array *a, int64_t t, int64_t b )
+   {
+      Array *n = new Array( a->size * 2 );
+      for ( int64_t i = t; i < b; i++ )
+         n->put( i, a->get( i ) );
+
+      m_retired.push_back( a );
+      m_array.store( n, std::memory_order_release );
+      return n;
+   }
+
+   // top is written by thieves, bottom only by the owner
+   std::atomic<int64_t> m_top;
+   char m_pad1[SATOMIC_CACHE_LINE - sizeof(std::atomic<int64_t>)];
+   std::atomic<int64_t> m_bottom;
+   char m_pad2[SATOMIC_CACHE_LINE - sizeof(std::atomic<int64_t>)];
+   std::atomic<Array*> m_array;
+   std::vector<Array*> m_retired;
+};
+
+__thread SThreadPoolWorker *tlsWorker = NULL;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class SThreadPoolWorker : public SThread
+{
+public:
+   SThreadPoolWorker( SThreadPool &pool, size_t index )
+      : m_pool( pool ),
+        m_index( index ),
+        m_random( (uint32_t)index * 2654435761u + 1 )
+   {
+   }
+
+   unsigned long threadProc( void *arg )
+   {
+      tlsWorker = this;
+      m_pool.workerLoop( *this );
+      tlsWorker = NULL;
+      return 0;
+   }
+
+   // xorshift, only used to pick a victim to steal from
+   uint32_t random()
+   {
+      m_random ^= m_random << 13;
+      m_random ^= m_random >> 17;
+      m_random ^= m_random << 5;
+      return m_random;
+   }
+
+   SThreadPool &m_pool;
+   size_t m_index;
+   uint32_t m_random;
+   SWorkDeque m_deque;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void SThreadPoolLoop::work()
+{
+   size_t chunk;
+
+   while ( ( chunk = m_next.fetch_add( 1, std::memory_order_relaxed ) ) < m_chunks )
+   {
+      try
+      {
+         runChunk( chunk );
+      }
+      catch ( ... )
+      {
+         SMutexLock l( m_errorMutex );
+         if ( !m_error )
+            m_error = std::current_exception();
+      }
+
+      if ( m_remaining.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+      {
+         m_done.store( 1, std::memory_order_release );
+         SFutex::wake( m_done, INT_MAX );
+      }
+   }
+}
+
+namespace
+{
+
+class SThreadPoolLoopTask : public SThreadPoolTask
+{
+public:
+   SThreadPoolLoopTask( const std::shared_ptr<SThreadPoolLoop> &loop ) : m_loop( loop ) {}
+   void run() { m_loop->work(); }
+
+private:
+   std::shared_ptr<SThreadPoolLoop> m_loop;
+};
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+SThreadPool::SThreadPool()
+   : m_injected( 0 ),
+     m_seq( 0 ),
+     m_sleepers( 0 ),
+     m_stop( false )
+{
+}
+
+SThreadPool::~SThreadPool()
+{
+   shutdown();
+}
+
+void SThreadPool::init( size_t workers )
+{
+   if ( !m_workers.empty() )
+      SError::throwRuntimeException( "SThreadPool::init() - the pool is already running" );
+
+   if ( workers == 0 )
+   {
+      long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+      workers = cpus > 0 ? (size_t)cpus : 1;
+   }
+
+   m_stop.store( false );
+
+   // every worker needs to see the others' deques before it starts stealing
+   for ( size_t i = 0; i < workers; i++ )
+      m_workers.push_back( new SThreadPoolWorker( *this, i ) );
+
+   for ( size_t i = 0; i < workers; i++ )
+   {
+      SThreadOptions options( m_options );
+
+      // thread names are limited to 15 characters
+      char name[16];
+      snprintf( name, sizeof(name), "%s-%u", m_options.name.empty() ? "pool" : m_options.name.c_str(), (unsigned int)i );
+      options.name = name;
+
+      if ( !m_options.cpus.empty() )
+         options.cpus.assign( 1, m_options.cpus[i % m_options.cpus.size()] );
+
+      try
+      {
+         m_workers[i]->init( NULL, options );
+      }
+      catch ( ... )
+      {
+         // joining a worker that never started is a no-op
+         shutdown();
+         throw;
+      }
+   }
+}
+
+void SThreadPool::shutdown()
+{
+   if ( m_workers.empty() )
+      return;
+
+   m_stop.store( true );
+   m_seq.fetch_add( 1 );
+   SFutex::wake( m_seq, INT_MAX );
+
+   for ( std::vector<SThreadPoolWorker*>::iterator it = m_workers.begin(); it != m_workers.end(); ++it )
+      (*it)->join();
+
+   for ( std::vector<SThreadPoolWorker*>::iterator it = m_workers.begin(); it != m_workers.end(); ++it )
+      delete *it;
+
+   m_workers.clear();
+}
+
+int SThreadPool::getWorkerIndex()
+{
+   SThreadPoolWorker *w = currentWorker();
+   return w ? (int)w->m_index : -1;
+}
+
+SThreadPoolWorker *SThreadPool::currentWorker()
+{
+   return tlsWorker && &tlsWorker->m_pool == this ? tlsWorker : NULL;
+}
+
+void SThreadPool::enqueue( SThreadPoolTask *task )
+{
+   SThreadPoolWorker *w = currentWorker();
+
+   if ( w )
+   {
+      w->m_deque.push( task );
+   }
+   else
+   {
+      if ( m_workers.empty() )
+      {
+         delete task;
+         SError::throwRuntimeException( "SThreadPool::enqueue() - the pool is not running" );
+      }
+
+      SMutexLock l( m_injectMutex );
+      m_inject.push_back( task );
+      m_injected.fetch_add( 1, std::memory_order_relaxed );
+   }
+
+   notify();
+}
+
+void SThreadPool::notify()
+{
+   // pairs with the increment of m_sleepers in workerLoop()
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+
+   if ( m_sleepers.load( std::memory_order_relaxed ) > 0 )
+   {
+      m_seq.fetch_add( 1, std::memory_order_release );
+      SFutex::wake( m_seq, 1 );
+   }
+}
+
+size_t SThreadPool::getGrain( size_t count, size_t grain )
+{
+   if ( grain > 0 )
+      return grain;
+
+   size_t chunks = ( m_workers.size() + 1 ) * 4;
+   grain = count / chunks;
+   return grain > 0 ? grain : 1;
+}
+
+void SThreadPool::runLoop( std::shared_ptr<SThreadPoolLoop> loop )
+{
+   size_t helpers = loop->getChunks() - 1;
+   if ( helpers > m_workers.size() )
+      helpers = m_workers.size();
+
+   for ( size_t i = 0; i < helpers; i++ )
+      enqueue( new SThreadPoolLoopTask( loop ) );
+
+   loop->work();
+
+   // a worker keeps running other tasks until the stragglers are done
+   SThreadPoolWorker *w = currentWorker();
+
+   while ( !loop->isDone() )
+   {
+      if ( w )
+      {
+         SThreadPoolTask *task = findTask( w );
+         if ( task )
+         {
+            runTask( task );
+            continue;
+         }
+      }
+
+      SFutex::wait( loop->getDoneWord(), 0 );
+   }
+
+   loop->rethrow();
+}
+
+SThreadPoolTask *SThreadPool::findTask( SThreadPoolWorker *worker )
+{
+   SThreadPoolTask *task = worker->m_deque.take();
+   if ( task )
+      return task;
+
+   if ( m_injected.load( std::memory_order_relaxed ) > 0 )
+   {
+      SMutexLock l( m_injectMutex );
+      if ( !m_inject.empty() )
+      {
+         task = m_inject.front();
+         m_inject.pop_front();
+         m_injected.fetch_sub( 1, std::memory_order_relaxed );
+         return task;
+      }
+   }
+
+   size_t count = m_workers.size();
+   if ( count < 2 )
+      return NULL;
+
+   // two passes, a steal that loses a race does not mean the victim is empty
+   for ( int pass = 0; pass < 2; pass++ )
+   {
+      size_t start = worker->random() % count;
+      for ( size_t i = 0; i < count; i++ )
+      {
+         SThreadPoolWorker *victim = m_workers[( start + i ) % count];
+         if ( victim == worker || victim->m_deque.isEmpty() )
+            continue;
+
+         task = victim->m_deque.steal();
+         if ( task )
+            return task;
+      }
+   }
+
+   return NULL;
+}
+
+void SThreadPool::runTask( SThreadPoolTask *task )
+{
+   try
+   {
+      task->run();
+   }
+   catch ( ... )
+   {
+   }
+
+   delete task;
+}
+
+void SThreadPool::workerLoop( SThreadPoolWorker &worker )
+{
+   while ( true )
+   {
+      SThreadPoolTask *task = findTask( &worker );
+      if ( task )
+      {
+         runTask( task );
+         continue;
+      }
+
+      m_sleepers.fetch_add( 1, std::memory_order_seq_cst );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      int seq = m_seq.load( std::memory_order_seq_cst );
+
+      // a task queued before the increment above is found here, one queued
+      // after it sees the sleeper and bumps m_seq
+      task = findTask( &worker );
+      if ( task )
+      {
+         m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+         runTask( task );
+         continue;
+      }
+
+      if ( m_stop.load() )
+      {
+         m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+         break;
+      }
+
+      SFutex::wait( m_seq, seq );
+      m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+   }
+}
@@ -0,0 +1,222 @@
+/*
+* Copyright (c) 2017 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "stimerwheel.h"
+
+namespace
+{
+
+inline int digit( uint64_t tick, int level )
+{
+   return (int)( ( tick >> ( level * STIMERWHEEL_BITS ) ) & ( STIMERWHEEL_SLOTS - 1 ) );
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+STimerWheel::STimerWheel( uint64_t now )
+   : m_current( now ),
+     m_count( 0 )
+{
+   for ( int i = 0; i < STIMERWHEEL_LEVELS; i++ )
+      m_occupied[i] = 0;
+
+   // each slot is a circular list headed by a sentinel
+   for ( int i = 0; i < STIMERWHEEL_LEVELS * STIMERWHEEL_SLOTS; i++ )
+   {
+      m_slots[i].m_prev = &m_slots[i];
+      m_slots[i].m_next = &m_slots[i];
+   }
+}
+
+STimerWheel::~STimerWheel()
+{
+   clear();
+}
+
+void STimerWheel::start( STimerWheelNode &node, uint64_t expiry )
+{
+   if ( node.isActive() )
+      unlink( node );
+
+   node.m_expiry = expiry;
+   insert( node );
+}
+
+void STimerWheel::stop( STimerWheelNode &node )
+{
+   if ( node.isActive() )
+      unlink( node );
+}
+
+STimerWheelNode *STimerWheel::expire( uint64_t now )
+{
+   while ( true )
+   {
+      STimerWheelNode &head = m_slots[digit( m_current, 0 )];
+
+      if ( head.m_next != &head && m_current <= now )
+      {
+         STimerWheelNode *node = head.m_next;
+         unlink( *node );
+         return node;
+      }
+
+      // the wheel stays on now, a timer started for now fires on the next call
+      if ( m_current >= now )
+         return NULL;
+
+      //
+      // jump straight to the next tick with something to do, every slot in
+      // between is empty.  Landing on the start of a slot on an upper level
+      // moves its timers down, highest level first so they can keep moving.
+      //
+      uint64_t next;
+      if ( !getNextTick( next ) || next > now )
+         next = now;
+
+      m_current = next;
+
+      for ( int level = STIMERWHEEL_LEVELS - 1; level > 0; level-- )
+      {
+         if ( ( m_current & ( ( (uint64_t)1 << ( level * STIMERWHEEL_BITS ) ) - 1 ) ) == 0 )
+            cascade( level );
+      }
+   }
+}
+
+bool STimerWheel::getNextTick( uint64_t &tick )
+{
+   if ( m_count == 0 )
+      return false;
+
+   for ( int level = 0; level < STIMERWHEEL_LEVELS; level++ )
+   {
+      int shift = level * STIMERWHEEL_BITS;
+      int cur = digit( m_current, level );
+      uint64_t base = ( m_current >> ( shift + STIMERWHEEL_BITS ) ) << ( shift + STIMERWHEEL_BITS );
+
+      // a timer on level 0 is due in its slot, on the levels above the
+      // slots up to the current one are empty or hold parked timers
+      int slot = nextSlot( level, level == 0 ? cur : cur + 1 );
+
+      if ( slot < 0 && level == STIMERWHEEL_LEVELS - 1 )
+      {
+         slot = nextSlot( level, 0 );
+         if ( slot >= 0 )
+            base += (uint64_t)STIMERWHEEL_SLOTS << shift;
+      }
+
+      if ( slot >= 0 )
+      {
+         tick = base + ( (uint64_t)slot << shift );
+         return true;
+      }
+   }
+
+   return false;
+}
+
+void STimerWheel::clear()
+{
+   for ( int i = 0; i < STIMERWHEEL_LEVELS * STIMERWHEEL_SLOTS; i++ )
+   {
+      STimerWheelNode &head = m_slots[i];
+
+      while ( head.m_next != &head )
+         unlink( *head.m_next );
+   }
+}
+
+void STimerWheel::insert( STimerWheelNode &node )
+{
+   uint64_t expiry = node.m_expiry < m_current ? m_current : node.m_expiry;
+   uint64_t diff = expiry ^ m_current;
+   int level = diff == 0 ? 0 : ( 63 - __builtin_clzll( diff ) ) / STIMERWHEEL_BITS;
+   int slot;
+
+   if ( level < STIMERWHEEL_LEVELS )
+   {
+      slot = digit( expiry, level );
+   }
+   else
+   {
+      // beyond the reach of the top level, park it in slot 0 of the top
+      // level, which is refiled each time the top level wraps around
+      level = STIMERWHEEL_LEVELS - 1;
+      slot = 0;
+   }
+
+   STimerWheelNode &head = m_slots[level * STIMERWHEEL_SLOTS + slot];
+
+   node.m_slot = (uint16_t)( level * STIMERWHEEL_SLOTS + slot );
+   node.m_prev = head.m_prev;
+   node.m_next = &head;
+   head.m_prev->m_next = &node;
+   head.m_prev = &node;
+
+   m_occupied[level] |= (uint64_t)1 << slot;
+   m_count++;
+}
+
+void STimerWheel::unlink( STimerWheelNode &node )
+{
+   node.m_prev->m_next = node.m_next;
+   node.m_next->m_prev = node.m_prev;
+   node.m_prev = NULL;
+   node.m_next = NULL;
+
+   STimerWheelNode &head = m_slots[node.m_slot];
+   if ( head.m_next == &head )
+      m_occupied[node.m_slot / STIMERWHEEL_SLOTS] &= ~( (uint64_t)1 << ( node.m_slot % STIMERWHEEL_SLOTS ) );
+
+   m_count--;
+}
+
+void STimerWheel::cascade( int level )
+{
+   STimerWheelNode &head = m_slots[level * STIMERWHEEL_SLOTS + digit( m_current, level )];
+
+   if ( head.m_next == &head )
+      return;
+
+   // detach the whole list first, a parked timer may be filed back here
+   STimerWheelNode *node = head.m_next;
+   head.m_prev->m_next = NULL;
+   head.m_prev = &head;
+   head.m_next = &head;
+   m_occupied[level] &= ~( (uint64_t)1 << digit( m_current, level ) );
+
+   while ( node )
+   {
+      STimerWheelNode *next = node->m_next;
+      m_count--;
+      insert( *node );
+      node = next;
+   }
+}
+
+int STimerWheel::nextSlot( int level, int from )
+{
+   if ( from >= STIMERWHEEL_SLOTS )
+      return -1;
+
+   uint64_t bits = m_occupied[level] >> from;
+   return bits ? from + __builtin_ctzll( bits ) : -1;
+}